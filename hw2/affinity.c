@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include <linux/filter.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+
+#define AFFINITY_MAX_CPUS CPU_SETSIZE
+
+static int cpus[AFFINITY_MAX_CPUS];
+static int slots[AFFINITY_MAX_CPUS];
+static int num_cpus;
+
+int affinity_init(void) {
+  cpu_set_t set;
+  num_cpus = 0;
+  if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+    perror("Failed to read CPU affinity");
+    CPU_ZERO(&set);
+    CPU_SET(0, &set);
+  }
+  for (int cpu = 0; cpu < AFFINITY_MAX_CPUS; cpu++) {
+    slots[cpu] = -1;
+    if (CPU_ISSET(cpu, &set)) {
+      slots[cpu] = num_cpus;
+      cpus[num_cpus++] = cpu;
+    }
+  }
+  return num_cpus;
+}
+
+int affinity_cpu_count(void) {
+  return num_cpus;
+}
+
+int affinity_cpu(int i) {
+  return cpus[i % num_cpus];
+}
+
+int affinity_slot(int cpu) {
+  return cpu >= 0 && cpu < AFFINITY_MAX_CPUS ? slots[cpu] : -1;
+}
+
+void affinity_attr_set(pthread_attr_t *attr, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+void affinity_pin_self(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    fprintf(stderr, "Failed to pin thread to CPU %d\n", cpu);
+  }
+}
+
+int affinity_steer_reuseport(int socket_number) {
+  /* Select socket (CPU slot) = current CPU. This only matches slots to
+   * CPUs when the allowed set is 0..n-1, which is the common case. */
+  if (cpus[num_cpus - 1] != num_cpus - 1) return -1;
+  struct sock_filter code[] = {
+    {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+    {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog program = {.len = 2, .filter = code};
+  return setsockopt(socket_number, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+      &program, sizeof(program));
+}
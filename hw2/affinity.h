@@ -0,0 +1,30 @@
+#ifndef __AFFINITY__
+#define __AFFINITY__
+
+#include <pthread.h>
+
+/* AFFINITY maps workers and acceptors onto the CPUs this process may run
+ * on. Slot i of the CPU list is the i-th allowed CPU in ascending order. */
+
+/* Reads the allowed CPU set. Returns the number of allowed CPUs. */
+int affinity_init(void);
+int affinity_cpu_count(void);
+
+/* Returns the CPU for slot I (taken modulo the CPU count). */
+int affinity_cpu(int i);
+
+/* Returns the slot of CPU, or -1 if it is not in the allowed set. */
+int affinity_slot(int cpu);
+
+/* Makes threads created with ATTR start on CPU. Because memory is placed on
+ * the node of the CPU that first touches it, the thread's stack and the
+ * buffers it allocates then stay on that CPU's NUMA node. */
+void affinity_attr_set(pthread_attr_t *attr, int cpu);
+void affinity_pin_self(int cpu);
+
+/* Lets the kernel hand each connection on a SO_REUSEPORT group of
+ * affinity_cpu_count() sockets to the socket for the CPU that received it.
+ * SOCKET_NUMBER must be one of the group. Returns -1 if unsupported. */
+int affinity_steer_reuseport(int socket_number);
+
+#endif
@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "libhttp.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_MAX_CAPACITY (1 << 20)
+
+__thread arena_t *request_arena;
+
+void arena_init(arena_t *arena, size_t capacity) {
+  arena->base = malloc(capacity);
+  if (!arena->base) http_fatal_error("Malloc failed");
+  arena->capacity = capacity;
+  arena->used = 0;
+  arena->overflow = NULL;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (arena->used + size <= arena->capacity) {
+    void *pointer = arena->base + arena->used;
+    arena->used += size;
+    return pointer;
+  }
+
+  arena_chunk_t *chunk = malloc(sizeof(arena_chunk_t) + ARENA_ALIGN + size);
+  if (!chunk) http_fatal_error("Malloc failed");
+  chunk->next = arena->overflow;
+  arena->overflow = chunk;
+  arena->used += size;
+  return (void *) (((size_t) chunk->data + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1));
+}
+
+char *arena_strndup(arena_t *arena, char *string, size_t size) {
+  char *copy = arena_alloc(arena, size + 1);
+  memcpy(copy, string, size);
+  copy[size] = '\0';
+  return copy;
+}
+
+void arena_reset(arena_t *arena) {
+  if (arena->overflow) {
+    while (arena->overflow) {
+      arena_chunk_t *chunk = arena->overflow;
+      arena->overflow = chunk->next;
+      free(chunk);
+    }
+    /* Make room for a request as large as this one, within reason. */
+    size_t capacity = arena->used < ARENA_MAX_CAPACITY ? arena->used : ARENA_MAX_CAPACITY;
+    if (capacity > arena->capacity) {
+      free(arena->base);
+      arena_init(arena, capacity);
+    }
+  }
+  arena->used = 0;
+}
+
+void arena_destroy(arena_t *arena) {
+  arena_reset(arena);
+  free(arena->base);
+  arena->base = NULL;
+  arena->capacity = 0;
+}
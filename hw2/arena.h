@@ -0,0 +1,35 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <stddef.h>
+
+/* ARENA is a bump allocator for memory that lives exactly as long as one
+ * request. Each worker owns one arena and resets it after every request,
+ * which frees everything allocated from it at once. Allocations that do
+ * not fit spill into separately malloc'd chunks, and the next reset grows
+ * the arena to cover them, so in the steady state no request touches
+ * malloc or free. */
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  char data[0];
+} arena_chunk_t;
+
+typedef struct arena {
+  char *base;
+  size_t capacity;
+  size_t used;              // Bytes handed out, including spilled ones.
+  arena_chunk_t *overflow;  // Spilled allocations since the last reset.
+} arena_t;
+
+/* The arena of whatever request the calling thread is serving: the
+ * worker's own, or the running coroutine's. */
+extern __thread arena_t *request_arena;
+
+void arena_init(arena_t *arena, size_t capacity);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, char *string, size_t size);
+void arena_reset(arena_t *arena);
+void arena_destroy(arena_t *arena);
+
+#endif
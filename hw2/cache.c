@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "libhttp.h"
+#include "utlist.h"
+
+#define CACHE_BUCKETS 4096
+#define CACHE_IO_SIZE 8192
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t *buckets[CACHE_BUCKETS];
+static cache_entry_t *memory_lru;  // Most recently used first.
+static cache_entry_t *disk_lru;
+static size_t memory_used, memory_limit;
+static size_t disk_used, disk_limit;
+static char *disk_dir;
+static unsigned int disk_seq;
+
+static unsigned long hash_key(char *key) {
+  unsigned long hash = 14695981039346656037UL;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static char *header_dup(char *head, char *name) {
+  size_t len;
+  char *value = http_find_header(head, name, &len);
+  return value ? strndup(value, len) : NULL;
+}
+
+static time_t parse_http_date(char *value, size_t len) {
+  char date[64];
+  struct tm tm;
+  if (len >= sizeof(date)) return -1;
+  memcpy(date, value, len);
+  date[len] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  if (strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) return -1;
+  return timegm(&tm);
+}
+
+/* Returns the freshness lifetime HEAD grants in seconds, or -1 when it has
+ * none, and clears *storable if the response must not be cached. */
+static time_t freshness_lifetime(char *head, time_t now, int *storable) {
+  size_t len;
+  char *value;
+  time_t lifetime = -1, s_maxage = -1;
+
+  *storable = 1;
+  if ((value = http_find_header(head, "Cache-Control", &len)) != NULL) {
+    char *end = value + len;
+    while (value < end) {
+      while (value < end && (*value == ' ' || *value == ',')) value++;
+      char *token = value;
+      while (value < end && *value != ',') value++;
+      size_t token_len = value - token;
+      if (token_len >= 8 && strncasecmp(token, "no-store", 8) == 0) {
+        *storable = 0;
+      } else if (token_len >= 7 && strncasecmp(token, "private", 7) == 0) {
+        *storable = 0;
+      } else if (token_len >= 8 && strncasecmp(token, "no-cache", 8) == 0) {
+        lifetime = 0;
+        s_maxage = 0;
+      } else if (token_len > 9 && strncasecmp(token, "s-maxage=", 9) == 0) {
+        if (s_maxage != 0) s_maxage = atol(token + 9);
+      } else if (token_len > 8 && strncasecmp(token, "max-age=", 8) == 0) {
+        if (lifetime != 0) lifetime = atol(token + 8);
+      }
+    }
+  }
+  if (s_maxage >= 0) lifetime = s_maxage;
+
+  if (lifetime < 0 && (value = http_find_header(head, "Expires", &len)) != NULL) {
+    time_t expires = parse_http_date(value, len);
+    time_t date = now;
+    if ((value = http_find_header(head, "Date", &len)) != NULL) {
+      time_t parsed = parse_http_date(value, len);
+      if (parsed != -1) date = parsed;
+    }
+    /* An invalid Expires means "already expired". */
+    lifetime = expires == -1 || expires < date ? 0 : expires - date;
+  }
+
+  if (lifetime > 0 && (value = http_find_header(head, "Age", &len)) != NULL) {
+    time_t age = atol(value);
+    lifetime = age >= lifetime ? 0 : lifetime - age;
+  }
+  return lifetime;
+}
+
+time_t cache_policy(char *head, time_t now, int *storable) {
+  size_t len;
+  int status = 0;
+  char *space = strchr(head, ' ');
+  if (space) status = atoi(space + 1);
+
+  time_t lifetime = freshness_lifetime(head, now, storable);
+  if (status != 200 && status != 203 && status != 300 && status != 301 && status != 410) {
+    *storable = 0;
+  }
+  /* We key on the path alone, so anything that varies is never shared. */
+  if (http_find_header(head, "Vary", &len) && len > 0) {
+    *storable = 0;
+  }
+  /* A cookie being set belongs to the one client that asked. */
+  if (http_find_header(head, "Set-Cookie", &len)) {
+    *storable = 0;
+  }
+  if (lifetime < 0) {
+    /* Without explicit freshness keep the response only if it can be
+     * revalidated, and revalidate on every request. */
+    if (!http_find_header(head, "ETag", &len) &&
+        !http_find_header(head, "Last-Modified", &len)) {
+      *storable = 0;
+    }
+    lifetime = 0;
+  }
+  return now + lifetime;
+}
+
+void cache_init(size_t mem_limit, char *dir, size_t dir_limit) {
+  memory_limit = mem_limit;
+  disk_dir = dir;
+  disk_limit = dir_limit;
+}
+
+/* Entries on disk keep their spill file until the last reference is gone,
+ * so that readers who looked them up can still send them. */
+static void free_entry(cache_entry_t *entry) {
+  if (entry->state == CACHE_DISK) unlink(entry->disk_path);
+  free(entry->key);
+  free(entry->data);
+  free(entry->etag);
+  free(entry->last_modified);
+  free(entry);
+}
+
+/* Removes ENTRY from the table and its LRU list. Caller holds cache_lock. */
+static void unlink_entry(cache_entry_t *entry) {
+  cache_entry_t **link = &buckets[hash_key(entry->key) % CACHE_BUCKETS];
+  while (*link != entry) link = &(*link)->hnext;
+  *link = entry->hnext;
+  entry->linked = 0;
+
+  if (entry->state == CACHE_MEMORY) {
+    DL_DELETE(memory_lru, entry);
+    memory_used -= entry->size;
+  } else if (entry->state == CACHE_DISK) {
+    DL_DELETE(disk_lru, entry);
+    disk_used -= entry->size;
+  }
+  if (entry->refcount == 0) free_entry(entry);
+}
+
+cache_entry_t *cache_lookup(char *key) {
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t *entry = buckets[hash_key(key) % CACHE_BUCKETS];
+  while (entry && strcmp(entry->key, key) != 0) entry = entry->hnext;
+  if (entry) {
+    if (entry->state == CACHE_MEMORY) {
+      DL_DELETE(memory_lru, entry);
+      DL_PREPEND(memory_lru, entry);
+    } else if (entry->state == CACHE_DISK) {
+      DL_DELETE(disk_lru, entry);
+      DL_PREPEND(disk_lru, entry);
+    }
+    entry->refcount++;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return entry;
+}
+
+/* Drops a reference. Caller holds cache_lock. */
+static void put_entry(cache_entry_t *entry) {
+  if (--entry->refcount > 0) return;
+  if (!entry->linked) {
+    free_entry(entry);
+  } else if (entry->state == CACHE_DISK && entry->data) {
+    free(entry->data);
+    entry->data = NULL;
+  }
+}
+
+void cache_release(cache_entry_t *entry) {
+  pthread_mutex_lock(&cache_lock);
+  put_entry(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_refresh(cache_entry_t *entry, char *head) {
+  int storable;
+  time_t now = time(NULL);
+  time_t lifetime = freshness_lifetime(head, now, &storable);
+
+  pthread_mutex_lock(&cache_lock);
+  entry->expires = now + (lifetime >= 0 ? lifetime : entry->lifetime);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static int write_spill_file(cache_entry_t *entry) {
+  int fd = open(entry->disk_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) return -1;
+  char *data = entry->data;
+  size_t size = entry->size;
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      close(fd);
+      unlink(entry->disk_path);
+      return -1;
+    }
+    data += written;
+    size -= written;
+  }
+  close(fd);
+  return 0;
+}
+
+/* Moves least recently used entries out of memory until the limit holds.
+ * Called with cache_lock held; drops it while spill files are written. */
+static void evict(void) {
+  cache_entry_t *spill = NULL;
+
+  while (memory_used > memory_limit && memory_lru) {
+    cache_entry_t *victim = memory_lru->prev;  // utlist keeps the tail here.
+    if (!disk_dir || victim->size > disk_limit) {
+      unlink_entry(victim);
+      continue;
+    }
+    DL_DELETE(memory_lru, victim);
+    memory_used -= victim->size;
+    victim->state = CACHE_SPILLING;
+    victim->refcount++;
+    snprintf(victim->disk_path, sizeof(victim->disk_path), "%s/%016lx-%d-%u",
+        disk_dir, hash_key(victim->key), (int) getpid(), disk_seq++);
+    victim->spill_next = spill;
+    spill = victim;
+  }
+  if (!spill) return;
+
+  pthread_mutex_unlock(&cache_lock);
+  for (cache_entry_t *entry = spill; entry; entry = entry->spill_next) {
+    if (write_spill_file(entry) < 0) entry->disk_path[0] = '\0';
+  }
+  pthread_mutex_lock(&cache_lock);
+
+  while (spill) {
+    cache_entry_t *entry = spill;
+    spill = entry->spill_next;
+    if (entry->disk_path[0] == '\0') {
+      if (entry->linked) unlink_entry(entry);
+    } else if (!entry->linked) {
+      unlink(entry->disk_path);
+    } else {
+      entry->state = CACHE_DISK;
+      DL_PREPEND(disk_lru, entry);
+      disk_used += entry->size;
+      while (disk_used > disk_limit && disk_lru->prev != entry) {
+        unlink_entry(disk_lru->prev);
+      }
+    }
+    put_entry(entry);
+  }
+}
+
+void cache_store(char *key, char *data, size_t size, size_t head_size, time_t expires) {
+  cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+  if (!entry) {
+    free(data);
+    return;
+  }
+
+  char *head = strndup(data, head_size);
+  if (head) {
+    entry->etag = header_dup(head, "ETag");
+    entry->last_modified = header_dup(head, "Last-Modified");
+    free(head);
+  }
+  entry->key = strdup(key);
+  entry->data = data;
+  entry->size = size;
+  entry->expires = expires;
+  entry->lifetime = expires - time(NULL);
+  if (entry->lifetime < 0) entry->lifetime = 0;
+  entry->state = CACHE_MEMORY;
+  entry->linked = 1;
+
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t **bucket = &buckets[hash_key(key) % CACHE_BUCKETS];
+  cache_entry_t *old = *bucket;
+  while (old && strcmp(old->key, key) != 0) old = old->hnext;
+  if (old) unlink_entry(old);
+
+  entry->hnext = *bucket;
+  *bucket = entry;
+  DL_PREPEND(memory_lru, entry);
+  memory_used += size;
+  evict();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_send(cache_entry_t *entry, int fd) {
+  if (entry->data) {
+    http_send_data(fd, entry->data, entry->size);
+    return 0;
+  }
+
+  int file_fd = open(entry->disk_path, O_RDONLY);
+  if (file_fd < 0) return -1;
+  char buffer[CACHE_IO_SIZE];
+  ssize_t size;
+  while ((size = read(file_fd, buffer, sizeof(buffer))) > 0) {
+    http_send_data(fd, buffer, size);
+  }
+  close(file_fd);
+  return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/* CACHE stores complete upstream responses (status line, headers and body)
+ * for the caching proxy mode, keyed by request path. Entries live in a
+ * bounded in-memory LRU and, when a spill directory is configured, are
+ * written to disk instead of being dropped when memory runs out. */
+
+#define CACHE_MEMORY 0
+#define CACHE_SPILLING 1
+#define CACHE_DISK 2
+
+typedef struct cache_entry {
+  char *key;
+  char *data;           // Raw response, freed once spilled to disk.
+  size_t size;          // Bytes in data (head plus body).
+  time_t expires;       // Fresh until this time, revalidate afterwards.
+  time_t lifetime;      // Freshness granted when the response was stored.
+  char *etag;           // Validators for conditional requests, may be NULL.
+  char *last_modified;
+  int refcount;         // Threads currently serving this entry.
+  int state;            // CACHE_MEMORY, CACHE_SPILLING or CACHE_DISK.
+  int linked;           // Still reachable through the cache table.
+  char disk_path[256];
+  struct cache_entry *hnext;
+  struct cache_entry *spill_next;
+  struct cache_entry *next;
+  struct cache_entry *prev;
+} cache_entry_t;
+
+void cache_init(size_t mem_limit, char *disk_dir, size_t disk_limit);
+
+/* Returns the entry for KEY with a reference held, or NULL. Every successful
+ * lookup must be paired with cache_release(). */
+cache_entry_t *cache_lookup(char *key);
+void cache_release(cache_entry_t *entry);
+
+/* Inserts a response for KEY, taking ownership of DATA (SIZE bytes, the
+ * first HEAD_SIZE of which are the status line and headers). Replaces any
+ * existing entry for KEY. */
+void cache_store(char *key, char *data, size_t size, size_t head_size, time_t expires);
+
+/* Renews ENTRY after the upstream answered 304 with response HEAD. */
+void cache_refresh(cache_entry_t *entry, char *head);
+
+/* Writes the stored response to FD. Returns -1 if nothing could be sent. */
+int cache_send(cache_entry_t *entry, int fd);
+
+/* Applies Cache-Control/Expires/Age to a NUL-terminated response HEAD.
+ * Returns the absolute expiry time and sets *storable when the response
+ * may be cached at all. */
+time_t cache_policy(char *head, time_t now, int *storable);
+
+#endif
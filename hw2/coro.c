@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "libhttp.h"
+
+#define CORO_STACK_SIZE (256 * 1024)
+#define CORO_GUARD_SIZE 4096
+#define CORO_ARENA_SIZE 16384
+#define CORO_MAX_EVENTS 256
+
+/* Everything below belongs to the loop running on the calling thread. */
+static __thread int epoll_fd = -1;
+static __thread ucontext_t scheduler;
+static __thread coro_t *current;
+static __thread coro_t *ready_head, *ready_tail;
+static __thread coro_t *free_coros;
+static __thread coro_t *timed;
+static __thread coro_t **readers, **writers;  // Indexed by fd.
+static __thread int num_waiters;
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void make_ready(coro_t *coro) {
+  coro->next = NULL;
+  if (ready_tail) ready_tail->next = coro; else ready_head = coro;
+  ready_tail = coro;
+}
+
+static void trampoline(void) {
+  coro_t *coro = current;
+  coro->fn(coro->arg);
+  coro->done = 1;
+  if (coro->joiner) make_ready(coro->joiner);
+  /* uc_link returns to the scheduler, which recycles us unless joinable. */
+}
+
+static void recycle(coro_t *coro) {
+  arena_reset(&coro->arena);
+  coro->next = free_coros;
+  free_coros = coro;
+}
+
+/* Switches from the running coroutine back to the scheduler. */
+static void suspend(void) {
+  coro_t *coro = current;
+  swapcontext(&coro->context, &scheduler);
+}
+
+static void resume(coro_t *coro) {
+  arena_t *saved_arena = request_arena;
+  current = coro;
+  request_arena = &coro->arena;
+  swapcontext(&scheduler, &coro->context);
+  current = NULL;
+  request_arena = saved_arena;
+  if (coro->done && !coro->joinable) recycle(coro);
+}
+
+coro_t *coro_spawn(void (*fn)(void *), void *arg, int joinable) {
+  coro_t *coro = free_coros;
+  if (coro) {
+    free_coros = coro->next;
+  } else {
+    coro = calloc(1, sizeof(coro_t));
+    if (!coro) http_fatal_error("Malloc failed");
+    /* The stack grows down into a page that faults on overflow. */
+    char *mapping = mmap(NULL, CORO_GUARD_SIZE + CORO_STACK_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (mapping == MAP_FAILED) http_fatal_error("Cannot map coroutine stack");
+    mprotect(mapping, CORO_GUARD_SIZE, PROT_NONE);
+    coro->stack = mapping + CORO_GUARD_SIZE;
+    arena_init(&coro->arena, CORO_ARENA_SIZE);
+  }
+  coro->fn = fn;
+  coro->arg = arg;
+  coro->done = 0;
+  coro->joinable = joinable;
+  coro->joiner = NULL;
+  coro->deadline = 0;
+
+  getcontext(&coro->context);
+  coro->context.uc_stack.ss_sp = coro->stack;
+  coro->context.uc_stack.ss_size = CORO_STACK_SIZE;
+  coro->context.uc_link = &scheduler;
+  makecontext(&coro->context, trampoline, 0);
+  make_ready(coro);
+  return coro;
+}
+
+void coro_join(coro_t *coro) {
+  if (!coro->done) {
+    coro->joiner = current;
+    suspend();
+  }
+  recycle(coro);
+}
+
+void coro_yield(void) {
+  if (!current) return;
+  make_ready(current);
+  suspend();
+}
+
+int coro_active(void) {
+  return current != NULL;
+}
+
+static void grow_waiters(int fd) {
+  int size = num_waiters ? num_waiters : 1024;
+  while (size <= fd) size *= 2;
+  readers = realloc(readers, size * sizeof(coro_t *));
+  writers = realloc(writers, size * sizeof(coro_t *));
+  if (!readers || !writers) http_fatal_error("Malloc failed");
+  memset(readers + num_waiters, 0, (size - num_waiters) * sizeof(coro_t *));
+  memset(writers + num_waiters, 0, (size - num_waiters) * sizeof(coro_t *));
+  num_waiters = size;
+}
+
+static void remove_timed(coro_t *coro) {
+  coro_t **link = &timed;
+  while (*link && *link != coro) link = &(*link)->timed_next;
+  if (*link) *link = coro->timed_next;
+  coro->deadline = 0;
+}
+
+/* Makes the coroutine waiting in SLOT ready, if any, dropping every other
+ * record of its wait. */
+static void wake(coro_t **slot, int timed_out) {
+  coro_t *coro = *slot;
+  if (!coro) return;
+  if (readers[coro->wait_fd] == coro) readers[coro->wait_fd] = NULL;
+  if (writers[coro->wait_fd] == coro) writers[coro->wait_fd] = NULL;
+  if (coro->deadline) remove_timed(coro);
+  coro->timed_out = timed_out;
+  make_ready(coro);
+}
+
+int coro_poll(int fd, short events, int timeout_ms) {
+  if (!current) {
+    struct pollfd pfd = {.fd = fd, .events = events};
+    return poll(&pfd, 1, timeout_ms);
+  }
+
+  /* Modifying the registration re-reports whatever is already ready, so a
+   * level that was consumed as an edge earlier is not missed. */
+  struct epoll_event event = {
+    .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+    .data.fd = fd,
+  };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0 &&
+      (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)) {
+    return -1;
+  }
+
+  if (fd >= num_waiters) grow_waiters(fd);
+  if (events & POLLIN) readers[fd] = current;
+  if (events & POLLOUT) writers[fd] = current;
+  current->wait_fd = fd;
+  if (timeout_ms >= 0) {
+    current->deadline = now_ms() + timeout_ms;
+    current->timed_next = timed;
+    timed = current;
+  }
+  suspend();
+  return current->timed_out ? 0 : 1;
+}
+
+ssize_t coro_read(int fd, void *buffer, size_t size) {
+  while (1) {
+    ssize_t bytes_read = read(fd, buffer, size);
+    if (bytes_read >= 0 || !current) return bytes_read;
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (coro_poll(fd, POLLIN, -1) < 0) return -1;
+  }
+}
+
+ssize_t coro_write(int fd, const void *buffer, size_t size) {
+  while (1) {
+    ssize_t bytes_written = write(fd, buffer, size);
+    if (bytes_written >= 0 || !current) return bytes_written;
+    if (errno == EINTR) continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (coro_poll(fd, POLLOUT, -1) < 0) return -1;
+  }
+}
+
+/* Wakes waits whose deadline has passed and returns the milliseconds until
+ * the next one, or -1 if none is pending. */
+static int expire_timers(void) {
+  long now = now_ms(), next = -1;
+  coro_t **link = &timed;
+  while (*link) {
+    coro_t *coro = *link;
+    if (coro->deadline <= now) {
+      wake(&coro, 1);
+    } else {
+      if (next < 0 || coro->deadline - now < next) next = coro->deadline - now;
+      link = &coro->timed_next;
+    }
+  }
+  return next;
+}
+
+void coro_loop_run(void (*main)(void *), void *arg) {
+  struct epoll_event events[CORO_MAX_EVENTS];
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) http_fatal_error("Cannot create epoll instance");
+  grow_waiters(0);
+  coro_spawn(main, arg, 0);
+
+  while (1) {
+    while (ready_head) {
+      coro_t *coro = ready_head;
+      ready_head = coro->next;
+      if (!ready_head) ready_tail = NULL;
+      resume(coro);
+    }
+
+    int timeout = expire_timers();
+    if (ready_head) continue;
+    int count = epoll_wait(epoll_fd, events, CORO_MAX_EVENTS, timeout);
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if (fd >= num_waiters) continue;
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        wake(&readers[fd], 0);
+      }
+      if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        wake(&writers[fd], 0);
+      }
+    }
+  }
+}
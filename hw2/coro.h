@@ -0,0 +1,58 @@
+#ifndef __CORO__
+#define __CORO__
+
+#include <sys/types.h>
+#include <ucontext.h>
+
+#include "arena.h"
+
+/* CORO runs blocking-style request handlers as stackful coroutines on a
+ * per-thread epoll loop. Sockets are non-blocking; when coro_read() or
+ * coro_write() would block, the coroutine is parked until epoll reports
+ * the fd ready and other coroutines run meanwhile. Outside a coroutine the
+ * same calls are plain read()/write()/poll(), so code written against
+ * them works in both the threaded and the event-loop server.
+ *
+ * Each coroutine has its own arena, installed as request_arena whenever it
+ * runs. Stacks and arenas are recycled through a per-loop free list. */
+
+typedef struct coro {
+  ucontext_t context;
+  char *stack;              // CORO_STACK_SIZE bytes above a guard page.
+  arena_t arena;
+  void (*fn)(void *);
+  void *arg;
+  int done;
+  int joinable;             // Kept after finishing until coro_join().
+  int timed_out;            // The last wait hit its deadline.
+  long deadline;            // Milliseconds, 0 when the wait has none.
+  int wait_fd;
+  struct coro *joiner;
+  struct coro *next;        // Ready queue or free list.
+  struct coro *timed_next;  // Waits with a deadline.
+} coro_t;
+
+/* Runs an event loop on the calling thread, starting with a coroutine
+ * running MAIN(ARG). Does not return. */
+void coro_loop_run(void (*main)(void *), void *arg);
+
+/* Starts FN(ARG) as a new coroutine on the current loop. A JOINABLE one
+ * must be passed to coro_join() exactly once. */
+coro_t *coro_spawn(void (*fn)(void *), void *arg, int joinable);
+void coro_join(coro_t *coro);
+
+/* Lets every other ready coroutine run before continuing. */
+void coro_yield(void);
+
+/* Non-zero when called from inside a coroutine. */
+int coro_active(void);
+
+/* Waits until FD has POLLIN or POLLOUT (EVENTS) or TIMEOUT_MS passes (-1
+ * waits forever). Returns 1 when ready and 0 on timeout, like poll(). With
+ * no EVENTS it simply sleeps. Ready may be spurious, so retry the I/O. */
+int coro_poll(int fd, short events, int timeout_ms);
+
+ssize_t coro_read(int fd, void *buffer, size_t size);
+ssize_t coro_write(int fd, const void *buffer, size_t size);
+
+#endif
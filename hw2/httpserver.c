@@ -1,24 +1,46 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "affinity.h"
+#include "arena.h"
+#include "cache.h"
+#include "coro.h"
+#include "inflight.h"
 #include "libhttp.h"
+#include "prefetch.h"
+#include "ratelimit.h"
+#include "sched.h"
+#include "trace.h"
+#include "upstream.h"
 #include "wq.h"
 
 #define BUFFER_SIZE 1024
+#define FILE_BUFFER_SIZE 16384
+#define ARENA_SIZE 65536
+#define ACCEPT_BATCH 64
+#define DEFER_ACCEPT_SECONDS 5
+#define PROXY_HEAD_MAX 8192
+#define PROXY_IO_SIZE 16384
 
 /*
  * Global configuration variables.
@@ -27,11 +49,31 @@
  * command line arguments (already implemented for you).
  */
 wq_t work_queue;
+wq_t *worker_queues;
+wq_t large_queue;
 int num_threads;
+int large_threads;
+int num_acceptors = 1;
+int num_processes = 1;
+int process_index = -1;  // Index of this child, -1 in the parent.
+pid_t *child_pids;
+int cpu_base;            // First CPU slot for this process.
+int health_interval = 5;
+char *health_path = "/";
+int server_backlog = 1024;
+int pin_workers;
+int use_coroutines;
+int rate_limit, rate_burst, max_conns_per_ip;
+int trace_sample;
+char *trace_file = "httpserver-trace.json";
+int prefetch;
+size_t prefetch_window;
+off_t drop_behind = (off_t) 256 << 20;
+void (*coroutine_request_handler)(int);
 int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
-int server_proxy_port;
+size_t proxy_cache_max_object;
 
 typedef struct arg_pair {
     int from;
@@ -72,23 +114,22 @@ void internal_error_res(int fd) {
 }
 
 void response_file(int fd, char* file_path) {
-    char file_buffer[BUFFER_SIZE];
-    char file_size_str[BUFFER_SIZE];
-    int file_size;
-
-    memset(file_buffer, '\0', BUFFER_SIZE);
-    memset(file_size_str, '\0', BUFFER_SIZE);
+    char *file_buffer = arena_alloc(request_arena, FILE_BUFFER_SIZE);
+    char file_size_str[32];
+    struct stat file_stat;
+    ssize_t size;
 
-    FILE* fp = fopen(file_path, "r");
+    int file_fd = open(file_path, O_RDONLY);
 
-    if (!fp) {
+    if (file_fd < 0) {
         return not_found_res(fd);
     }
-
-    fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
-    rewind(fp);
-    sprintf(file_size_str, "%d", file_size);
+    if (fstat(file_fd, &file_stat) < 0) {
+        close(file_fd);
+        return internal_error_res(fd);
+    }
+    snprintf(file_size_str, sizeof(file_size_str), "%lld", (long long) file_stat.st_size);
+    prefetch_open(file_fd, file_stat.st_size);
 
     http_start_response(fd, 200);
     printf("%s\n", http_get_mime_type(file_path));
@@ -96,40 +137,38 @@ void response_file(int fd, char* file_path) {
     http_send_header(fd, "Content-Length", file_size_str);
     http_send_header(fd, "Server", "httpserver/1.0");
     http_end_headers(fd);
-    while(!feof(fp)) {
-        memset(file_buffer, '\0', BUFFER_SIZE);
-        fread(file_buffer, 1, BUFFER_SIZE, fp);
-        http_send_string(fd, file_buffer);
+    off_t offset = 0;
+    while((size = read(file_fd, file_buffer, FILE_BUFFER_SIZE)) > 0) {
+        http_send_data(fd, file_buffer, size);
+        prefetch_advance(file_fd, offset, offset + size, file_stat.st_size);
+        offset += size;
     }
-    close(fd);
+    close(file_fd);
 }
 
 void list_response(int fd, char* dir_path, char* request_path) {
     DIR* dp;
     struct dirent *ep;
-    char res_buff[BUFFER_SIZE];
-    memset(res_buff, '\0', BUFFER_SIZE);
     if ((dp = opendir(dir_path)) == NULL) {
         return not_found_res(fd);
     }
-    strcpy(res_buff, "<html><body><ul>");
-    while((ep = readdir(dp)) != NULL) {
-        char link_buffer[BUFFER_SIZE];
-        char html_buffer[BUFFER_SIZE];
-        memset(link_buffer, '\0', BUFFER_SIZE);
-        memset(html_buffer, '\0', BUFFER_SIZE);
-        strcpy(link_buffer, request_path);
-        strcat(link_buffer, ep->d_name);
-        sprintf(html_buffer, "<li><a href=\"%s\">%s</a></li>", link_buffer, ep->d_name);
-        strcat(res_buff, html_buffer);
-    }
-    strcat(res_buff, "</ul></body></html>");
 
     http_start_response(fd, 200);
     http_send_header(fd, "Content-Type", "text/html");
     http_send_header(fd, "Server", "httpserver/1.0");
     http_end_headers(fd);
-    http_send_string(fd, res_buff);
+    http_send_string(fd, "<html><body><ul>");
+    size_t request_path_len = strlen(request_path);
+    while((ep = readdir(dp)) != NULL) {
+        /* Two copies of the name, the request path and the markup. */
+        size_t size = request_path_len + 2 * strlen(ep->d_name) + 32;
+        char *html_buffer = arena_alloc(request_arena, size);
+        snprintf(html_buffer, size, "<li><a href=\"%s%s\">%s</a></li>",
+                 request_path, ep->d_name, ep->d_name);
+        http_send_string(fd, html_buffer);
+    }
+    http_send_string(fd, "</ul></body></html>");
+    closedir(dp);
 }
 
 void* proxy_child_worker(void *arg) {
@@ -137,14 +176,18 @@ void* proxy_child_worker(void *arg) {
     arg_t* pair = (arg_t*) arg;
     char buffer[BUFFER_SIZE];
     int size;
-    while((size = read(pair->from, buffer, BUFFER_SIZE)) > 0) {
-        write(pair->to, buffer, size);
+    while((size = coro_read(pair->from, buffer, BUFFER_SIZE)) > 0) {
+        http_send_data(pair->to, buffer, size);
         printf("from %d to %d: %d bytes \n", pair->from, pair->to, size);
     }
     printf("thread_id %i finish\n", (unsigned int)(pthread_self() % 100));
     return NULL;
 }
 
+void proxy_child_coroutine(void *arg) {
+    proxy_child_worker(arg);
+}
+
 
 /*
  * Reads an HTTP request from stream (fd), and writes an HTTP response
@@ -159,217 +202,815 @@ void* proxy_child_worker(void *arg) {
  */
 void handle_files_request(int fd) {
 
-  /*
-   * TODO: Your solution for Task 1 goes here! Feel free to delete/modify *
-   * any existing code.
-   */
-
-  struct http_request *request = http_request_parse(fd);
+  struct http_request *request = http_request_parse(fd, request_arena);
 
   if (request == NULL) {
     return internal_error_res(fd);
   }
-
-  char file_path[BUFFER_SIZE];
-  memset(file_path, '\0', BUFFER_SIZE);
-  strcpy(file_path, server_files_directory);
-  strcat(file_path, request->path);
+  trace_mark(fd, TRACE_PARSED);
+  trace_path(fd, request->path);
+
+  /* Room for the path, a trailing slash and "index.html". */
+  size_t directory_len = strlen(server_files_directory);
+  size_t path_len = strlen(request->path);
+  char *file_path = arena_alloc(request_arena, directory_len + path_len + 12);
+  memcpy(file_path, server_files_directory, directory_len);
+  memcpy(file_path + directory_len, request->path, path_len + 1);
   printf("file path is %s \n", file_path);
 
   struct stat path_stat;
   int status;
-  if ((status = stat(file_path, &path_stat)) == -1) {
+  status = stat(file_path, &path_stat);
+  trace_mark(fd, TRACE_RESOLVED);
+  if (status == -1) {
       return not_found_res(fd);
   }
   if (S_ISREG(path_stat.st_mode)) {
+    if (large_threads) sched_record(request->path, path_stat.st_size);
     return response_file(fd, file_path);
   } else if (S_ISDIR(path_stat.st_mode)) {
     // Default return index.html as all http servers.
-    char dir_path[BUFFER_SIZE];
-    int len = strlen(file_path);
+    size_t len = directory_len + path_len;
     if (file_path[len - 1] != '/') {
-      strcat(file_path, "/");
+      file_path[len++] = '/';
     }
-    strcpy(dir_path, file_path);
-    strcat(file_path, "index.html");
-    FILE* fp = fopen(file_path, "r");
-
-    if (!fp) {
-      char request_path[BUFFER_SIZE];
-      strcpy(request_path, request->path);
-      int len = strlen(request_path);
-      if (request_path[len - 1] != '/') {
-        strcat(request_path, "/");
+    char *dir_path = arena_strndup(request_arena, file_path, len);
+    strcpy(file_path + len, "index.html");
+
+    if (stat(file_path, &path_stat) < 0) {
+      char *request_path = arena_alloc(request_arena, path_len + 2);
+      memcpy(request_path, request->path, path_len + 1);
+      if (path_len == 0 || request_path[path_len - 1] != '/') {
+        strcpy(request_path + path_len, "/");
       }
       return list_response(fd, dir_path, request_path);
     }
+    if (large_threads) sched_record(request->path, path_stat.st_size);
     return response_file(fd, file_path);
   }
   return not_found_res(fd);
 }
 
 
+void bad_gateway_res(int fd) {
+  http_start_response(fd, 502);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_end_headers(fd);
+  http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+}
+
+/*
+ * Relays bytes both ways between the client fd and the proxy target. Under
+ * --coroutines the upstream-to-client direction runs as a second coroutine
+ * on the same loop instead of a thread.
+ */
+void relay_proxy_connection(int fd, int client_socket_fd) {
+  if (coro_active()) {
+    arg_t to_client = {.from = client_socket_fd, .to = fd};
+    coro_t *proxy_server = coro_spawn(proxy_child_coroutine, &to_client, 1);
+    proxy_child_worker(&(arg_t) {.from = fd, .to = client_socket_fd});
+    coro_join(proxy_server);
+    close(client_socket_fd);
+    return;
+  }
+
+  pthread_t proxy_client;
+  pthread_t proxy_server;
+  pthread_create(&proxy_client, NULL, proxy_child_worker, &(arg_t) {.from = fd, .to = client_socket_fd});
+  pthread_create(&proxy_server, NULL, proxy_child_worker, &(arg_t) {.from = client_socket_fd, .to = fd});
+  pthread_join(proxy_client, NULL);
+  pthread_join(proxy_server, NULL);
+  printf("Finish for one connection \n");
+  close(client_socket_fd);
+}
+
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
+ * Opens a connection to one of the proxy targets (picked by the balancing
+ * policy, keyed by the client address) and relays traffic to/from the
+ * stream fd and the proxy target. HTTP requests from the client (fd) should
+ * be sent to the proxy target, and HTTP responses from the proxy target
+ * should be sent to the client (fd).
  *
  *   +--------+     +------------+     +--------------+
  *   | client | <-> | httpserver | <-> | proxy target |
  *   +--------+     +------------+     +--------------+
  */
 void handle_proxy_request(int fd) {
+  struct sockaddr_in client_address;
+  socklen_t client_address_length = sizeof(client_address);
+  char client_ip[INET_ADDRSTRLEN] = "";
+  if (getpeername(fd, (struct sockaddr *) &client_address, &client_address_length) == 0) {
+    inet_ntop(AF_INET, &client_address.sin_addr, client_ip, sizeof(client_ip));
+  }
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+  upstream_t *upstream;
+  int client_socket_fd = upstream_connect(client_ip, &upstream);
+  trace_mark(fd, TRACE_RESOLVED);
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
+  if (client_socket_fd < 0) {
+    /* Dummy request parsing, just to be compliant. */
+    http_request_parse(fd, request_arena);
+    return bad_gateway_res(fd);
+  }
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+  relay_proxy_connection(fd, client_socket_fd);
+  upstream_release(upstream);
+}
 
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
+/*
+ * Reads from fd into buffer until it holds a complete message head (ending
+ * in an empty line) or size bytes. Returns the number of bytes read, which
+ * may run past the head, and stores the length of the head in *head_size.
+ * Returns -1 if the peer closed or sent more than size bytes of headers.
+ */
+int read_message_head(int fd, char *buffer, size_t size, size_t *head_size) {
+  size_t total = 0;
+  ssize_t bytes_read;
+  while (total < size && (bytes_read = read(fd, buffer + total, size - total)) > 0) {
+    total += bytes_read;
+    buffer[total] = '\0';
+    char *end = strstr(buffer, "\r\n\r\n");
+    if (end) {
+      *head_size = end + 4 - buffer;
+      return total;
+    }
   }
+  return -1;
+}
+
+int header_line_is(char *line, char *name) {
+  size_t len = strlen(name);
+  return strncasecmp(line, name, len) == 0 && line[len] == ':';
+}
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+/*
+ * Writes the upstream request for a cacheable GET: the client's request line
+ * and headers downgraded to HTTP/1.0 with hop-by-hop headers dropped. When a
+ * stale entry is being revalidated its validators replace the client's.
+ * Returns -1, having sent nothing, when the request does not fit.
+ */
+int send_upstream_request(int upstream, char *request, char *path,
+    cache_entry_t *stale) {
+  char upstream_request[PROXY_HEAD_MAX + BUFFER_SIZE];
+  size_t size = 0, capacity = sizeof(upstream_request);
+  int written = snprintf(upstream_request, capacity, "GET %s HTTP/1.0\r\n", path);
+  if (written < 0 || (size_t) written >= capacity) {
+    return -1;
+  }
+  size = written;
+
+  char *line = strstr(request, "\r\n") + 2;
+  while (strncmp(line, "\r\n", 2) != 0) {
+    char *line_end = strstr(line, "\r\n") + 2;
+    int skip = header_line_is(line, "Connection") ||
+        header_line_is(line, "Keep-Alive") ||
+        header_line_is(line, "Proxy-Connection") ||
+        header_line_is(line, "TE") ||
+        header_line_is(line, "Upgrade");
+    if (stale) {
+      skip = skip || header_line_is(line, "If-None-Match") ||
+          header_line_is(line, "If-Modified-Since");
+    }
+    if (!skip && size + (line_end - line) < PROXY_HEAD_MAX) {
+      memcpy(upstream_request + size, line, line_end - line);
+      size += line_end - line;
+    }
+    line = line_end;
   }
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+  if (stale && stale->etag) {
+    written = snprintf(upstream_request + size, capacity - size,
+        "If-None-Match: %.400s\r\n", stale->etag);
+    if (written < 0 || (size_t) written >= capacity - size) {
+      return -1;
+    }
+    size += written;
+  }
+  if (stale && stale->last_modified) {
+    written = snprintf(upstream_request + size, capacity - size,
+        "If-Modified-Since: %.400s\r\n", stale->last_modified);
+    if (written < 0 || (size_t) written >= capacity - size) {
+      return -1;
+    }
+    size += written;
+  }
+  written = snprintf(upstream_request + size, capacity - size, "Connection: close\r\n\r\n");
+  if (written < 0 || (size_t) written >= capacity - size) {
+    return -1;
+  }
+  size += written;
+  http_send_data(upstream, upstream_request, size);
+  return 0;
+}
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+/*
+ * Streams the upstream response to the client and to the requests coalesced
+ * into flight (if any) while keeping a copy of it, and stores the copy if
+ * the response turns out to be cacheable. Responses that cache_policy would
+ * not store are not shared either: the flight is finished unshared and its
+ * followers fetch their own. So are responses too big to cache, as soon as
+ * they are known to be, so that what the flight buffers stays within
+ * proxy_cache_max_object. A 304 answer to a revalidation is served from
+ * the stale entry instead. Returns the state to finish the flight with.
+ */
+int relay_and_cache_response(int fd, int upstream, char *path,
+    cache_entry_t *stale, inflight_t *flight) {
+  char buffer[PROXY_IO_SIZE];
+  char *response = NULL;
+  size_t response_size = 0, capacity = 0, head_size = 0, shared = 0;
+  time_t expires = 0;
+  int storable = 0;
+  ssize_t size;
+
+  while ((size = read(upstream, buffer, sizeof(buffer))) > 0) {
+    if (head_size > 0) {
+      http_send_data(fd, buffer, size);
+      if (flight && shared + size > proxy_cache_max_object && !flight->committed) {
+        inflight_finish(flight, INFLIGHT_UNSHARED);
+        flight = NULL;
+      }
+      /* A committed flight has room for all the upstream promised; it
+       * gets no more than that. */
+      if (flight && shared + size <= proxy_cache_max_object) {
+        inflight_append(flight, buffer, size);
+        shared += size;
+      }
+      if (!response) continue;
+      if (response_size + size > proxy_cache_max_object) {
+        free(response);
+        response = NULL;
+        continue;
+      }
+    }
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+    if (response_size + size + 1 > capacity) {
+      capacity = (response_size + size + 1) * 2;
+      response = realloc(response, capacity);
+      if (!response) http_fatal_error("Malloc failed");
+    }
+    memcpy(response + response_size, buffer, size);
+    response_size += size;
+    response[response_size] = '\0';
+    if (head_size > 0) continue;
+
+    char *head_end = strstr(response, "\r\n\r\n");
+    if (!head_end && response_size < PROXY_HEAD_MAX) continue;
+
+    head_size = head_end ? head_end + 4 - response : response_size;
+    int status = 0;
+    sscanf(response, "HTTP/%*s %d", &status);
+    if (head_end && stale && status == 304) {
+      cache_refresh(stale, response);
+      free(response);
+      return cache_send(stale, fd) < 0 ? INFLIGHT_FAILED : INFLIGHT_REVALIDATED;
+    }
+    if (head_end) expires = cache_policy(response, time(NULL), &storable);
+    http_send_data(fd, response, response_size);
+    if (flight && (!storable || response_size > proxy_cache_max_object)) {
+      inflight_finish(flight, INFLIGHT_UNSHARED);
+      flight = NULL;
+    }
+    if (flight) {
+      size_t len;
+      char *content_length = http_find_header(response, "Content-Length", &len);
+      if (content_length && head_size + atol(content_length) <= proxy_cache_max_object) {
+        inflight_commit(flight);
+      }
+      inflight_append(flight, response, response_size);
+      shared = response_size;
+    }
+    if (!storable) {
+      free(response);
+      response = NULL;
+    }
+  }
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
+  if (head_size == 0 && response_size == 0) {
+    return INFLIGHT_FAILED;
+  } else if (head_size == 0) {
+    /* The upstream closed before finishing its headers; pass on what came. */
+    http_send_data(fd, response, response_size);
+    if (flight) inflight_finish(flight, INFLIGHT_UNSHARED);
+  } else if (response && size == 0) {
+    size_t len;
+    char *content_length = http_find_header(response, "Content-Length", &len);
+    if (!content_length || atol(content_length) == response_size - head_size) {
+      cache_store(path, response, response_size, head_size, expires);
+      return INFLIGHT_DONE;
+    }
+  }
+  free(response);
+  return INFLIGHT_DONE;
+}
+
+/*
+ * Caching variant of handle_proxy_request. GET requests are answered from
+ * the response cache while the stored copy is fresh; otherwise the upstream
+ * is asked (conditionally, when a stale copy exists) and cacheable answers
+ * are stored on the way through. Concurrent GETs for the same path share a
+ * single upstream fetch, unless they carry cookies, whose responses may be
+ * meant for that client alone. Everything else is relayed untouched.
+ */
+void handle_caching_proxy_request(int fd) {
+  char request[PROXY_HEAD_MAX + 1];
+  size_t head_size, len;
+  int request_size = read_message_head(fd, request, PROXY_HEAD_MAX, &head_size);
+  if (request_size < 0) {
+    return;
+  }
+
+  char method[16], path[PROXY_HEAD_MAX];
+  if (sscanf(request, "%15s %8191s", method, path) != 2) {
+    http_start_response(fd, 400);
     http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
     return;
+  }
+  trace_mark(fd, TRACE_PARSED);
+  trace_path(fd, path);
+
+  int upstream;
+  upstream_t *target;
+  if (strcmp(method, "GET") != 0 || http_find_header(request, "Authorization", &len)) {
+    if ((upstream = upstream_connect(path, &target)) < 0) {
+      return bad_gateway_res(fd);
+    }
+    http_send_data(upstream, request, request_size);
+    relay_proxy_connection(fd, upstream);
+    return upstream_release(target);
+  }
 
+  cache_entry_t *entry = cache_lookup(path);
+  trace_mark(fd, TRACE_RESOLVED);
+  if (entry && entry->expires > time(NULL) && cache_send(entry, fd) == 0) {
+    if (large_threads) sched_record(path, entry->size);
+    return cache_release(entry);
   }
+  if (large_threads) sched_record(path, SCHED_SLOW);
 
-  pthread_t proxy_client;
-  pthread_t proxy_server;
-  pthread_create(&proxy_client, NULL, proxy_child_worker, &(arg_t) {.from = fd, .to = client_socket_fd});
-  pthread_create(&proxy_server, NULL, proxy_child_worker, &(arg_t) {.from = client_socket_fd, .to = fd});
-  pthread_join(proxy_client, NULL);
-  pthread_join(proxy_server, NULL);
-  printf("Finish for one connection \n");
+  int leader = 1, fetched = 0, too_long = 0, state = INFLIGHT_UNSHARED;
+  inflight_t *flight = NULL;
+  if (!http_find_header(request, "Cookie", &len)) {
+    flight = inflight_join(path, &leader);
+    if (!leader) state = inflight_stream(flight, fd);
+  }
+  if (state == INFLIGHT_UNSHARED) {
+    /* A leader, or a follower whose leader's response was not shareable. */
+    state = INFLIGHT_FAILED;
+    fetched = 1;
+    if ((upstream = upstream_connect(path, &target)) >= 0) {
+      if (send_upstream_request(upstream, request, path, entry) < 0) {
+        /* Nothing was sent; any followers find out for themselves. */
+        too_long = 1;
+        state = INFLIGHT_UNSHARED;
+      } else {
+        state = relay_and_cache_response(fd, upstream, path, entry, leader ? flight : NULL);
+      }
+      close(upstream);
+      upstream_release(target);
+    }
+  }
+  if (flight && leader) inflight_finish(flight, state);
+  if (flight) inflight_release(flight);
+
+  if (state == INFLIGHT_REVALIDATED && !fetched) {
+    if (!entry) entry = cache_lookup(path);
+    if (!entry || cache_send(entry, fd) < 0) state = INFLIGHT_FAILED;
+  }
+  if (entry) cache_release(entry);
+  if (too_long) {
+    http_start_response(fd, 414);
+    http_end_headers(fd);
+  } else if (state == INFLIGHT_FAILED) {
+    bad_gateway_res(fd);
+  }
+}
+
+/*
+ * Applies the per-client limits to a freshly accepted connection. Clients
+ * over them are answered with a 429 and closed right here, before they
+ * can take a queue slot or a worker. Returns whether fd is to be served.
+ */
+int admit_connection(int fd, struct sockaddr_in *client_address) {
+  if (!ratelimit_enabled() || ratelimit_admit(fd, client_address) == RATELIMIT_OK) {
+    return 1;
+  }
+  ratelimit_reject(fd);
+  close(fd);
+  return 0;
+}
+
+/* Closes a connection once its handler is done with it. */
+void close_connection(int fd) {
+  trace_end(fd);
+  ratelimit_release(fd);
   close(fd);
-  close(client_socket_fd);
-  /* 
-  * TODO: Your solution for task 3 belongs here! 
-  */
 }
 
+typedef struct worker_arg {
+    void (*request_handler)(int);
+    wq_t *queue;
+} worker_arg_t;
+
 void* worker(void* arg) {
-    void (*request_handler)(int) = arg;
-    pthread_mutex_lock(&work_queue.lock);
+    worker_arg_t *worker_arg = arg;
+    arena_t arena;
+    arena_init(&arena, ARENA_SIZE);
+    request_arena = &arena;
     while(1) {
-        while(work_queue.size == 0) {
-            pthread_cond_wait(&work_queue.cond, &work_queue.lock);
-        }
+        int fd = wq_pop(worker_arg->queue);
+        trace_mark(fd, TRACE_DEQUEUE);
         printf("Served by thread_id %i \n", (unsigned int)(pthread_self() % 100));
-        int fd = wq_pop(&work_queue);
-        request_handler(fd);
-        close(fd);
+        worker_arg->request_handler(fd);
+        close_connection(fd);
+        arena_reset(&arena);
     }
     return NULL;
 
 }
 
+/* Starts a worker serving queue, bound to cpu unless that is -1. */
+void start_worker(void (*request_handler)(int), wq_t *queue, int cpu) {
+  pthread_t thread;
+  pthread_attr_t attr;
+  worker_arg_t *arg = malloc(sizeof(worker_arg_t));
+  arg->request_handler = request_handler;
+  arg->queue = queue;
+  pthread_attr_init(&attr);
+  if (cpu >= 0) {
+    affinity_attr_set(&attr, cpu);
+  }
+  pthread_create(&thread, &attr, worker, arg);
+  pthread_attr_destroy(&attr);
+}
+
+/*
+ * Starts num_threads workers. With pin_workers, worker i runs only on CPU
+ * slot i (modulo the number of CPUs) and has its own queue, so that
+ * dispatch() can hand it connections that arrived on its CPU. With
+ * large_threads, that many more workers serve large_queue.
+ */
 void init_thread_pool(int num_threads, void (*request_handler)(int)) {
-  /*
-   * TODO: Part of your solution for Task 2 goes here!
-   */
+  wq_init(&work_queue);
+  if (pin_workers) {
+    worker_queues = malloc(num_threads * sizeof(wq_t));
+  }
   for (size_t i = 0; i < num_threads; ++i) {
-      pthread_t* ptr = malloc(sizeof(pthread_t));
-      pthread_create(ptr, NULL, worker, request_handler);
+      if (pin_workers) {
+          wq_init(&worker_queues[i]);
+          start_worker(request_handler, &worker_queues[i], affinity_cpu(cpu_base + i));
+      } else {
+          start_worker(request_handler, &work_queue, -1);
+      }
+  }
+
+  wq_init(&large_queue);
+  for (size_t i = 0; i < large_threads; ++i) {
+      start_worker(request_handler, &large_queue, -1);
   }
 }
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Hands an accepted connection to a worker. With large_threads, requests
+ * known to be large go to the separate large pool, known small ones to the
+ * fast lane and the rest to the slow lane. Pinned workers get the
+ * connections whose packets the kernel processed on their own CPU
+ * (SO_INCOMING_CPU), so the socket state is already in that CPU's cache.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+void dispatch(int client_socket_number, void (*request_handler)(int)) {
+  if (num_threads == 0) {
+    request_handler(client_socket_number);
+    close_connection(client_socket_number);
+    arena_reset(request_arena);
+    return;
+  }
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+  int lane = WQ_LANE_FAST;
+  if (large_threads) {
+    int class = sched_classify(client_socket_number);
+    if (class == SCHED_LARGE) {
+      trace_mark(client_socket_number, TRACE_ENQUEUE);
+      wq_push(&large_queue, client_socket_number);
+      return;
+    }
+    lane = class == SCHED_SMALL ? WQ_LANE_FAST : WQ_LANE_SLOW;
+  }
+  if (!pin_workers) {
+    trace_mark(client_socket_number, TRACE_ENQUEUE);
+    wq_push_lane(&work_queue, client_socket_number, lane);
+    return;
+  }
+
+  static unsigned int next_worker;
+  int incoming_cpu = -1;
+  socklen_t length = sizeof(incoming_cpu);
+  getsockopt(client_socket_number, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &length);
+
+  int num_cpus = affinity_cpu_count();
+  int slot = affinity_slot(incoming_cpu);
+  unsigned int turn = __sync_fetch_and_add(&next_worker, 1);
+  int index;
+  if (slot >= 0) {
+    /* Worker i is pinned to slot cpu_base + i; find the first one here. */
+    slot = ((slot - cpu_base) % num_cpus + num_cpus) % num_cpus;
+  }
+  if (slot < 0 || slot >= num_threads) {
+    index = turn % num_threads;
+  } else {
+    /* Workers slot, slot + num_cpus, ... all run on this CPU. */
+    int on_cpu = (num_threads - slot + num_cpus - 1) / num_cpus;
+    index = slot + num_cpus * (turn % on_cpu);
+  }
+  trace_mark(client_socket_number, TRACE_ENQUEUE);
+  wq_push_lane(&worker_queues[index], client_socket_number, lane);
+}
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+/* Hands a batch of accepted connections over with one queue operation. */
+void dispatch_batch(int *client_socket_numbers, int count, void (*request_handler)(int)) {
+  if (num_threads > 0 && !pin_workers && !large_threads) {
+    for (int i = 0; i < count; i++) {
+      trace_mark(client_socket_numbers[i], TRACE_ENQUEUE);
+    }
+    wq_push_batch(&work_queue, client_socket_numbers, count);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    dispatch(client_socket_numbers[i], request_handler);
+  }
+}
+
+/*
+ * Opens a TCP stream socket on all interfaces with port number server_port
+ * and starts listening. With reuseport, several such sockets may share the
+ * port and the kernel spreads connections over them.
+ */
+int open_server_socket(int reuseport) {
+
+  struct sockaddr_in server_address;
+  int socket_number = socket(PF_INET, SOCK_STREAM, 0);
+  if (socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+  if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
         sizeof(socket_option)) == -1) {
     perror("Failed to set socket options");
     exit(errno);
   }
+  if (reuseport && setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT,
+        &socket_option, sizeof(socket_option)) == -1) {
+    perror("Failed to set socket options");
+    exit(errno);
+  }
 
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
   server_address.sin_port = htons(server_port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(socket_number, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
     perror("Failed to bind on socket");
     exit(errno);
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  /* Only wake the acceptor once the request has arrived, and let clients
+   * that support it send that request along with the SYN. */
+  socket_option = DEFER_ACCEPT_SECONDS;
+  if (setsockopt(socket_number, IPPROTO_TCP, TCP_DEFER_ACCEPT, &socket_option,
+        sizeof(socket_option)) == -1) {
+    perror("Failed to set TCP_DEFER_ACCEPT (ignoring)");
+  }
+  socket_option = server_backlog;
+  if (setsockopt(socket_number, IPPROTO_TCP, TCP_FASTOPEN, &socket_option,
+        sizeof(socket_option)) == -1) {
+    perror("Failed to set TCP_FASTOPEN (ignoring)");
+  }
+
+  if (listen(socket_number, server_backlog) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
 
-  printf("Listening on port %d...\n", server_port);
+  /* The acceptor drains the backlog until accept4 would block. */
+  fcntl(socket_number, F_SETFL, fcntl(socket_number, F_GETFL) | O_NONBLOCK);
+  return socket_number;
+}
 
-  init_thread_pool(num_threads, request_handler);
+typedef struct acceptor_arg {
+  int socket_number;
+  int cpu;
+  void (*request_handler)(int);
+} acceptor_arg_t;
+
+/* Serves one connection accepted by accept_coroutine(). */
+void connection_coroutine(void *arg) {
+  int client_socket_number = (intptr_t) arg;
+  trace_mark(client_socket_number, TRACE_DEQUEUE);
+  coroutine_request_handler(client_socket_number);
+  close_connection(client_socket_number);
+}
+
+/*
+ * The first coroutine of each acceptor's loop under --coroutines. Accepts
+ * non-blocking connections and starts a coroutine for each; the handlers
+ * run until they would block, so one thread serves many connections.
+ */
+void accept_coroutine(void *arg) {
+  acceptor_arg_t *acceptor_arg = arg;
+  coroutine_request_handler = acceptor_arg->request_handler;
 
   while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
-    if (client_socket_number < 0) {
-      perror("Error accepting socket");
-      continue;
+    int count = 0;
+    while (count < ACCEPT_BATCH) {
+      struct sockaddr_in client_address;
+      socklen_t client_address_length = sizeof(client_address);
+      int client_socket_number = accept4(acceptor_arg->socket_number,
+          (struct sockaddr *) &client_address, &client_address_length,
+          SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client_socket_number >= 0) {
+        if (!admit_connection(client_socket_number, &client_address)) continue;
+        trace_begin(client_socket_number);
+        coro_spawn(connection_coroutine, (void *) (intptr_t) client_socket_number, 0);
+        count++;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      } else if (errno != EINTR && errno != ECONNABORTED) {
+        perror("Error accepting socket");
+        /* Sleep without waiting for any event. */
+        if (count == 0) coro_poll(acceptor_arg->socket_number, 0, 10);
+        break;
+      }
     }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
-
-    if (num_threads == 0) {
-        request_handler(client_socket_number);
-        close(client_socket_number);
+    if (count < ACCEPT_BATCH) {
+      coro_poll(acceptor_arg->socket_number, POLLIN, -1);
     } else {
-        pthread_mutex_lock(&work_queue.lock);
-        wq_push(&work_queue, client_socket_number);
-        pthread_cond_signal(&work_queue.cond);
-        pthread_mutex_unlock(&work_queue.lock);
+      coro_yield();
     }
   }
+}
+
+/*
+ * Waits for the listening socket to become readable, then accepts every
+ * pending connection (up to ACCEPT_BATCH at a time) before handing the
+ * whole batch to the workers. The connections themselves stay blocking,
+ * which is what the handlers expect.
+ */
+void* acceptor(void* arg) {
+  acceptor_arg_t *acceptor_arg = arg;
+  int batch[ACCEPT_BATCH];
+  struct pollfd pfd = {.fd = acceptor_arg->socket_number, .events = POLLIN};
+
+  if (acceptor_arg->cpu >= 0) {
+    affinity_pin_self(acceptor_arg->cpu);
+  }
+  if (use_coroutines) {
+    coro_loop_run(accept_coroutine, acceptor_arg);
+  }
+  if (num_threads == 0) {
+    /* Requests are handled right here. */
+    request_arena = malloc(sizeof(arena_t));
+    arena_init(request_arena, ARENA_SIZE);
+  }
+
+  while (1) {
+    int count = 0;
+    while (count < ACCEPT_BATCH) {
+      struct sockaddr_in client_address;
+      socklen_t client_address_length = sizeof(client_address);
+      int client_socket_number = accept4(acceptor_arg->socket_number,
+          (struct sockaddr *) &client_address, &client_address_length, SOCK_CLOEXEC);
+      if (client_socket_number >= 0) {
+        if (!admit_connection(client_socket_number, &client_address)) continue;
+        trace_begin(client_socket_number);
+        batch[count++] = client_socket_number;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      } else if (errno != EINTR && errno != ECONNABORTED) {
+        perror("Error accepting socket");
+        /* Out of fds and the like: back off instead of spinning. */
+        if (count == 0) poll(NULL, 0, 10);
+        break;
+      }
+    }
+
+    if (count > 0) {
+      dispatch_batch(batch, count, acceptor_arg->request_handler);
+    }
+    if (count < ACCEPT_BATCH) {
+      poll(&pfd, 1, -1);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Forks num_processes children that serve on the listening sockets
+ * inherited from the parent. Returns in each child with process_index set;
+ * the parent stays here for good, restarting any child that exits.
+ */
+void fork_processes(void) {
+  child_pids = calloc(num_processes, sizeof(pid_t));
+  time_t *started = calloc(num_processes, sizeof(time_t));
+
+  for (int i = 0; i < num_processes; i++) {
+    started[i] = time(NULL);
+    if ((child_pids[i] = fork()) == 0) {
+      process_index = i;
+      return;
+    } else if (child_pids[i] < 0) {
+      perror("Failed to fork");
+      exit(errno);
+    }
+  }
+
+  while (1) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      perror("Failed to wait for children");
+      exit(errno);
+    }
+    for (int i = 0; i < num_processes; i++) {
+      if (child_pids[i] != pid) continue;
+      if (WIFSIGNALED(status)) {
+        fprintf(stderr, "Process %d (pid %d) killed by signal %d, restarting\n",
+            i, pid, WTERMSIG(status));
+      } else {
+        fprintf(stderr, "Process %d (pid %d) exited with status %d, restarting\n",
+            i, pid, WEXITSTATUS(status));
+      }
+      /* Do not spin if a child dies right away every time. */
+      if (time(NULL) - started[i] < 1) {
+        sleep(1);
+      }
+      started[i] = time(NULL);
+      if ((child_pids[i] = fork()) == 0) {
+        process_index = i;
+        free(started);
+        return;
+      } else if (child_pids[i] < 0) {
+        perror("Failed to fork");
+      }
+    }
+  }
+}
+
+/*
+ * Opens num_acceptors listening sockets on port server_port (sharing it
+ * with SO_REUSEPORT when there are several). Saves the fd number of the
+ * first server socket in *socket_number. With num_processes, the sockets
+ * are shared by that many forked processes, each with its own threads,
+ * queues and caches. Each socket gets its own acceptor thread, pinned to a
+ * CPU along with the workers under --pin-workers; for each accepted
+ * connection a worker calls request_handler with the accepted fd number.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+  int reuseport = num_acceptors > 1;
+  acceptor_arg_t *args = malloc(num_acceptors * sizeof(acceptor_arg_t));
+
+  for (int i = 0; i < num_acceptors; i++) {
+    args[i].socket_number = open_server_socket(reuseport);
+    args[i].request_handler = request_handler;
+  }
+  *socket_number = args[0].socket_number;
+  int steered = 0;
+  if (pin_workers && num_acceptors == affinity_cpu_count() && num_acceptors > 1) {
+    steered = affinity_steer_reuseport(*socket_number) == 0;
+    if (!steered) fprintf(stderr, "Cannot steer connections to the acceptor on their CPU\n");
+  }
+
+  printf("Listening on port %d...\n", server_port);
+
+  /* Nothing below may run before the fork: threads do not survive it. */
+  if (num_processes > 1) {
+    fork_processes();
+    cpu_base = process_index * (num_threads > num_acceptors ? num_threads : num_acceptors);
+  }
+
+  if (server_proxy_hostname && health_interval > 0) {
+    upstream_start_health_checks(health_interval, health_path);
+  }
+  if (server_files_directory && prefetch) {
+    prefetch_start();
+  }
+  trace_start();
+  init_thread_pool(num_threads, request_handler);
+
+  /* Steering sends CPU i's connections to socket i, in every process, so
+   * its acceptors stay on those CPUs; only the workers move by cpu_base. */
+  for (int i = 0; i < num_acceptors; i++) {
+    args[i].cpu = pin_workers ? affinity_cpu(steered ? i : cpu_base + i) : -1;
+  }
+  for (int i = 1; i < num_acceptors; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, acceptor, &args[i]);
+  }
+  acceptor(&args[0]);
+
   shutdown(*socket_number, SHUT_RDWR);
   close(*socket_number);
 }
@@ -377,6 +1018,11 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
 int server_fd;
 void signal_callback_handler(int signum) {
   printf("Caught signal %d: %s\n", signum, strsignal(signum));
+  if (child_pids && process_index < 0) {
+    for (int i = 0; i < num_processes; i++) {
+      if (child_pids[i] > 0) kill(child_pids[i], SIGTERM);
+    }
+  }
   printf("Closing socket %d\n", server_fd);
   if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
   exit(0);
@@ -384,7 +1030,15 @@ void signal_callback_handler(int signum) {
 
 char *USAGE =
   "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "                    [--prefetch] [--prefetch-window KB] [--drop-behind MB]\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80[,host:port...] --port 8000 [--num-threads 5]\n"
+  "                    [--lb round-robin|least-conn|hash] [--health-interval 5] [--health-path /]\n"
+  "                    [--proxy-cache [--cache-size MB] [--cache-dir DIR [--cache-disk-size MB]]]\n"
+  "       common options: [--processes N] [--pin-workers] [--acceptors N] [--backlog 1024]\n"
+  "                       [--coroutines] [--max-conns-per-ip N]\n"
+  "                       [--rate-limit PER_SECOND [--rate-burst N]]\n"
+  "                       [--trace-sample N [--trace-file httpserver-trace.json]]\n"
+  "                       [--large-threads N [--large-threshold KB]]\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -393,10 +1047,16 @@ void exit_with_usage() {
 
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
   void (*request_handler)(int) = NULL;
+  int proxy_cache = 0;
+  int lb_policy = LB_ROUND_ROBIN;
+  long large_threshold = 1024;
+  size_t cache_size = 64, cache_disk_size = 1024;
+  char *cache_dir = NULL;
 
   int i;
   for (i = 1; i < argc; i++) {
@@ -411,20 +1071,34 @@ int main(int argc, char **argv) {
     } else if (strcmp("--proxy", argv[i]) == 0) {
       request_handler = handle_proxy_request;
 
-      char *proxy_target = argv[++i];
-      if (!proxy_target) {
+      server_proxy_hostname = argv[++i];
+      if (!server_proxy_hostname) {
         fprintf(stderr, "Expected argument after --proxy\n");
         exit_with_usage();
       }
-
-      char *colon_pointer = strchr(proxy_target, ':');
-      if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = atoi(colon_pointer + 1);
+    } else if (strcmp("--lb", argv[i]) == 0) {
+      char *lb_str = argv[++i];
+      if (lb_str && strcmp(lb_str, "round-robin") == 0) {
+        lb_policy = LB_ROUND_ROBIN;
+      } else if (lb_str && strcmp(lb_str, "least-conn") == 0) {
+        lb_policy = LB_LEAST_CONN;
+      } else if (lb_str && strcmp(lb_str, "hash") == 0) {
+        lb_policy = LB_HASH;
       } else {
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = 80;
+        fprintf(stderr, "Expected round-robin, least-conn or hash after --lb\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--health-interval", argv[i]) == 0) {
+      char *health_interval_str = argv[++i];
+      if (!health_interval_str || (health_interval = atoi(health_interval_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --health-interval\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--health-path", argv[i]) == 0) {
+      health_path = argv[++i];
+      if (!health_path) {
+        fprintf(stderr, "Expected argument after --health-path\n");
+        exit_with_usage();
       }
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
@@ -439,6 +1113,108 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--large-threads", argv[i]) == 0) {
+      char *large_threads_str = argv[++i];
+      if (!large_threads_str || (large_threads = atoi(large_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --large-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--large-threshold", argv[i]) == 0) {
+      char *large_threshold_str = argv[++i];
+      if (!large_threshold_str || (large_threshold = atol(large_threshold_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --large-threshold\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--pin-workers", argv[i]) == 0) {
+      pin_workers = 1;
+    } else if (strcmp("--backlog", argv[i]) == 0) {
+      char *backlog_str = argv[++i];
+      if (!backlog_str || (server_backlog = atoi(backlog_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --backlog\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--processes", argv[i]) == 0) {
+      char *num_processes_str = argv[++i];
+      if (!num_processes_str || (num_processes = atoi(num_processes_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --processes\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--acceptors", argv[i]) == 0) {
+      char *num_acceptors_str = argv[++i];
+      if (!num_acceptors_str || (num_acceptors = atoi(num_acceptors_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --acceptors\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--prefetch", argv[i]) == 0) {
+      prefetch = 1;
+    } else if (strcmp("--prefetch-window", argv[i]) == 0) {
+      char *prefetch_window_str = argv[++i];
+      long window;
+      if (!prefetch_window_str || (window = atol(prefetch_window_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --prefetch-window\n");
+        exit_with_usage();
+      }
+      prefetch_window = (size_t) window << 10;
+    } else if (strcmp("--drop-behind", argv[i]) == 0) {
+      char *drop_behind_str = argv[++i];
+      long size;
+      if (!drop_behind_str || (size = atol(drop_behind_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --drop-behind\n");
+        exit_with_usage();
+      }
+      drop_behind = (off_t) size << 20;
+    } else if (strcmp("--rate-limit", argv[i]) == 0) {
+      char *rate_limit_str = argv[++i];
+      if (!rate_limit_str || (rate_limit = atoi(rate_limit_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --rate-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-burst", argv[i]) == 0) {
+      char *rate_burst_str = argv[++i];
+      if (!rate_burst_str || (rate_burst = atoi(rate_burst_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --rate-burst\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-conns-per-ip", argv[i]) == 0) {
+      char *max_conns_str = argv[++i];
+      if (!max_conns_str || (max_conns_per_ip = atoi(max_conns_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-conns-per-ip\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--trace-sample", argv[i]) == 0) {
+      char *trace_sample_str = argv[++i];
+      if (!trace_sample_str || (trace_sample = atoi(trace_sample_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --trace-sample\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--trace-file", argv[i]) == 0) {
+      trace_file = argv[++i];
+      if (!trace_file) {
+        fprintf(stderr, "Expected argument after --trace-file\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--coroutines", argv[i]) == 0) {
+      use_coroutines = 1;
+    } else if (strcmp("--proxy-cache", argv[i]) == 0) {
+      proxy_cache = 1;
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str || (cache_size = atol(cache_size_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --cache-size\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-dir", argv[i]) == 0) {
+      cache_dir = argv[++i];
+      if (!cache_dir) {
+        fprintf(stderr, "Expected argument after --cache-dir\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-disk-size", argv[i]) == 0) {
+      char *cache_disk_size_str = argv[++i];
+      if (!cache_disk_size_str || (cache_disk_size = atol(cache_disk_size_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --cache-disk-size\n");
+        exit_with_usage();
+      }
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -454,12 +1230,46 @@ int main(int argc, char **argv) {
   }
 
   if (server_proxy_hostname) {
+      upstream_init(server_proxy_hostname, lb_policy);
+  }
+
+  if (use_coroutines && proxy_cache) {
+      // Coalesced requests wait on condition variables, which would block
+      // the whole loop.
+      fprintf(stderr, "--proxy-cache cannot be combined with --coroutines\n");
+      exit_with_usage();
+  }
+
+  if (proxy_cache && server_proxy_hostname) {
+      // Cacheable GETs are served by the worker alone.
+      request_handler = handle_caching_proxy_request;
+      cache_init(cache_size << 20, cache_dir, cache_disk_size << 20);
+      proxy_cache_max_object = (cache_size << 20) / 8;
+  } else if (server_proxy_hostname) {
       // We use three thread to serve one connection.
       num_threads /= 3;
   }
 
+  if (use_coroutines) {
+      // Each acceptor thread runs an event loop and serves its own connections.
+      num_threads = 0;
+  }
+
   printf("Thread number is %d \n", num_threads);
 
+  if (pin_workers) {
+      printf("Pinning to %d CPUs \n", affinity_init());
+  }
+  if (num_threads == 0) {
+      // Nothing is queued, so there is nothing to schedule.
+      large_threads = 0;
+  }
+  sched_init(large_threshold << 10);
+  prefetch_init(prefetch_window, drop_behind);
+  ratelimit_init(rate_limit, rate_burst, max_conns_per_ip);
+  // Before any thread exists, so that SIGUSR1 stays blocked in all of them.
+  trace_init(trace_sample, trace_file);
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "inflight.h"
+#include "libhttp.h"
+
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+static inflight_t *flights;
+
+inflight_t *inflight_join(char *key, int *leader) {
+  pthread_mutex_lock(&inflight_lock);
+  inflight_t *flight = flights;
+  while (flight && strcmp(flight->key, key) != 0) flight = flight->next;
+
+  *leader = flight == NULL;
+  if (!flight) {
+    flight = calloc(1, sizeof(inflight_t));
+    if (!flight) http_fatal_error("Malloc failed");
+    flight->key = strdup(key);
+    flight->state = INFLIGHT_RUNNING;
+    pthread_cond_init(&flight->cond, NULL);
+    flight->next = flights;
+    flights = flight;
+  }
+  flight->refcount++;
+  pthread_mutex_unlock(&inflight_lock);
+  return flight;
+}
+
+void inflight_append(inflight_t *flight, char *data, size_t size) {
+  inflight_chunk_t *chunk = malloc(sizeof(inflight_chunk_t) + size);
+  if (!chunk) http_fatal_error("Malloc failed");
+  chunk->next = NULL;
+  chunk->size = size;
+  memcpy(chunk->data, data, size);
+
+  pthread_mutex_lock(&inflight_lock);
+  if (flight->tail) {
+    flight->tail->next = chunk;
+  } else {
+    flight->head = chunk;
+  }
+  flight->tail = chunk;
+  pthread_cond_broadcast(&flight->cond);
+  pthread_mutex_unlock(&inflight_lock);
+}
+
+void inflight_commit(inflight_t *flight) {
+  pthread_mutex_lock(&inflight_lock);
+  flight->committed = 1;
+  pthread_cond_broadcast(&flight->cond);
+  pthread_mutex_unlock(&inflight_lock);
+}
+
+void inflight_finish(inflight_t *flight, int state) {
+  pthread_mutex_lock(&inflight_lock);
+  inflight_t **link = &flights;
+  while (*link && *link != flight) link = &(*link)->next;
+  if (*link) *link = flight->next;
+  if (flight->state == INFLIGHT_RUNNING) flight->state = state;
+  pthread_cond_broadcast(&flight->cond);
+  pthread_mutex_unlock(&inflight_lock);
+}
+
+int inflight_stream(inflight_t *flight, int fd) {
+  inflight_chunk_t *sent = NULL;
+  pthread_mutex_lock(&inflight_lock);
+  while (1) {
+    inflight_chunk_t *chunk = sent ? sent->next : flight->head;
+    if (chunk && (flight->committed || flight->state == INFLIGHT_DONE)) {
+      pthread_mutex_unlock(&inflight_lock);
+      http_send_data(fd, chunk->data, chunk->size);
+      sent = chunk;
+      pthread_mutex_lock(&inflight_lock);
+    } else if (flight->state != INFLIGHT_RUNNING) {
+      break;
+    } else {
+      pthread_cond_wait(&flight->cond, &inflight_lock);
+    }
+  }
+  int state = flight->state;
+  pthread_mutex_unlock(&inflight_lock);
+  return state;
+}
+
+void inflight_release(inflight_t *flight) {
+  pthread_mutex_lock(&inflight_lock);
+  int last = --flight->refcount == 0;
+  pthread_mutex_unlock(&inflight_lock);
+  if (!last) return;
+
+  while (flight->head) {
+    inflight_chunk_t *chunk = flight->head;
+    flight->head = chunk->next;
+    free(chunk);
+  }
+  pthread_cond_destroy(&flight->cond);
+  free(flight->key);
+  free(flight);
+}
@@ -0,0 +1,59 @@
+#ifndef __INFLIGHT__
+#define __INFLIGHT__
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* INFLIGHT coalesces concurrent identical proxied GETs. The first request
+ * for a key becomes the leader and fetches from the upstream; requests for
+ * the same key that arrive meanwhile attach to the flight and are sent the
+ * leader's response bytes as they come in. */
+
+#define INFLIGHT_RUNNING 0
+#define INFLIGHT_DONE 1         // Complete response is in data.
+#define INFLIGHT_FAILED 2       // The upstream could not be reached.
+#define INFLIGHT_REVALIDATED 3  // Answered by a 304, the cache is fresh.
+#define INFLIGHT_UNSHARED 4     // Not for sharing: followers fetch their own.
+
+typedef struct inflight_chunk {
+  struct inflight_chunk *next;
+  size_t size;
+  char data[0];
+} inflight_chunk_t;
+
+typedef struct inflight {
+  char *key;
+  inflight_chunk_t *head;  // Response bytes received so far. Chunks are
+  inflight_chunk_t *tail;  // never changed once appended.
+  int committed;           // Followers may stream before the end.
+  int state;
+  int refcount;
+  pthread_cond_t cond;
+  struct inflight *next;
+} inflight_t;
+
+/* Returns the flight for KEY, creating it if there is none. *leader is set
+ * when the caller created it and must fetch the response. */
+inflight_t *inflight_join(char *key, int *leader);
+
+/* Leader side: publishes response bytes, then the final state. Followers
+ * only start sending once the flight is done or committed: the leader
+ * commits when it knows the whole response will be published, and
+ * otherwise, should the response outgrow what it is willing to buffer,
+ * finishes unshared with nothing sent to anyone. Finishing
+ * detaches the flight from KEY so later requests start a new one; only the
+ * first call counts, so a leader may finish early, with INFLIGHT_UNSHARED,
+ * as soon as it knows the response must not be shared. */
+void inflight_append(inflight_t *flight, char *data, size_t size);
+void inflight_commit(inflight_t *flight);
+void inflight_finish(inflight_t *flight, int state);
+
+/* Follower side: writes the response to FD as it arrives and returns the
+ * final state. Nothing has been written unless it returns INFLIGHT_DONE;
+ * the leader only appends once it knows it will not fail or revalidate
+ * and that the response may be shared. */
+int inflight_stream(inflight_t *flight, int fd);
+
+void inflight_release(inflight_t *flight);
+
+#endif
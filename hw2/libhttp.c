@@ -2,25 +2,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
+#include "coro.h"
 #include "libhttp.h"
+#include "trace.h"
 
 #define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_LINE_MAX_SIZE 512
 
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+struct http_request *http_request_parse(int fd, arena_t *arena) {
+  struct http_request *request = arena_alloc(arena, sizeof(struct http_request));
+  char *read_buffer = arena_alloc(arena, LIBHTTP_REQUEST_MAX_SIZE + 1);
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
-
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
+  int bytes_read = coro_read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
+  if (bytes_read < 0) return NULL;
   read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
 
   char *read_start, *read_end;
@@ -32,9 +34,7 @@ struct http_request *http_request_parse(int fd) {
     while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
     read_size = read_end - read_start;
     if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
+    request->method = arena_strndup(arena, read_start, read_size);
 
     /* Read in a space character. */
     read_start = read_end;
@@ -46,9 +46,7 @@ struct http_request *http_request_parse(int fd) {
     while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
     read_size = read_end - read_start;
     if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
+    request->path = arena_strndup(arena, read_start, read_size);
 
     /* Read in HTTP version and rest of request line: ".*" */
     read_start = read_end;
@@ -56,15 +54,11 @@ struct http_request *http_request_parse(int fd) {
     if (*read_end != '\n') break;
     read_end++;
 
-    free(read_buffer);
     return request;
   } while (0);
 
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+  /* An error occurred; the memory goes back with the arena. */
   return NULL;
-
 }
 
 char* http_get_response_message(int status_code) {
@@ -89,22 +83,37 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 414:
+      return "URI Too Long";
     default:
       return "Internal Server Error";
   }
 }
 
+/* dprintf() would write to the socket with no regard for EAGAIN, so lines
+ * are formatted here and go out through http_send_data(). */
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
+  char line[LIBHTTP_LINE_MAX_SIZE];
+  int size = snprintf(line, sizeof(line), "HTTP/1.0 %d %s\r\n", status_code,
       http_get_response_message(status_code));
+  http_send_data(fd, line, size);
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  char line[LIBHTTP_LINE_MAX_SIZE];
+  int size = snprintf(line, sizeof(line), "%s: %s\r\n", key, value);
+  if (size >= (int) sizeof(line)) {
+    http_send_string(fd, key);
+    http_send_string(fd, ": ");
+    http_send_string(fd, value);
+    http_send_string(fd, "\r\n");
+    return;
+  }
+  http_send_data(fd, line, size);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  http_send_data(fd, "\r\n", 2);
 }
 
 void http_send_string(int fd, char *data) {
@@ -113,8 +122,9 @@ void http_send_string(int fd, char *data) {
 
 void http_send_data(int fd, char *data, size_t size) {
   ssize_t bytes_sent;
+  trace_mark(fd, TRACE_FIRST_BYTE);
   while (size > 0) {
-    bytes_sent = write(fd, data, size);
+    bytes_sent = coro_write(fd, data, size);
     if (bytes_sent < 0)
       return;
     size -= bytes_sent;
@@ -144,3 +154,23 @@ char *http_get_mime_type(char *file_name) {
     return "text/plain";
   }
 }
+
+char *http_find_header(char *head, char *name, size_t *len) {
+  size_t name_len = strlen(name);
+  char *line = strchr(head, '\n');
+
+  /* Skip the request or status line, then look at one header per line. */
+  while (line != NULL && *++line != '\0' && *line != '\r' && *line != '\n') {
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      char *value = line + name_len + 1;
+      while (*value == ' ' || *value == '\t') value++;
+      char *value_end = value;
+      while (*value_end != '\0' && *value_end != '\r' && *value_end != '\n') value_end++;
+      while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+      *len = value_end - value;
+      return value;
+    }
+    line = strchr(line, '\n');
+  }
+  return NULL;
+}
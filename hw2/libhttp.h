@@ -3,8 +3,9 @@
  *
  * Usage example:
  *
- *     // Returns NULL if an error was encountered.
- *     struct http_request *request = http_request_parse(fd);
+ *     // Returns NULL if an error was encountered. The request is allocated
+ *     // from arena and lives until the arena is reset.
+ *     struct http_request *request = http_request_parse(fd, arena);
  *
  *     ...
  *
@@ -20,6 +21,8 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include "arena.h"
+
 /*
  * Functions for parsing an HTTP request.
  */
@@ -28,7 +31,12 @@ struct http_request {
   char *path;
 };
 
-struct http_request *http_request_parse(int fd);
+struct http_request *http_request_parse(int fd, arena_t *arena);
+
+/*
+ * Prints message and exits; used when allocation fails.
+ */
+void http_fatal_error(char *message);
 
 /*
  * Functions for sending an HTTP response.
@@ -44,4 +52,11 @@ void http_send_data(int fd, char *data, size_t size);
  */
 char *http_get_mime_type(char *file_name);
 
+/*
+ * Helper function: finds header NAME (case-insensitive) in a NUL-terminated
+ * raw message head and returns a pointer to its value, storing the length of
+ * the value in *LEN. Returns NULL if the header is absent.
+ */
+char *http_find_header(char *head, char *name, size_t *len);
+
 #endif
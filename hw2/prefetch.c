@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+
+#define PREFETCH_QUEUE_SIZE 256
+#define PREFETCH_AHEAD 4  // Windows kept in flight ahead of the cursor.
+
+typedef struct prefetch_request {
+  int fd;  // A dup() owned by the queue, closed once prefetched.
+  off_t offset;
+  size_t length;
+} prefetch_request_t;
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static prefetch_request_t queue[PREFETCH_QUEUE_SIZE];
+static unsigned int queue_head, queue_tail;
+static int running;
+static size_t prefetch_window = 1 << 20;
+static off_t prefetch_drop_behind;
+
+void prefetch_init(size_t window, off_t drop_behind) {
+  if (window > 0) prefetch_window = window;
+  prefetch_drop_behind = drop_behind;
+}
+
+static void *prefetch_worker(void *arg) {
+  while (1) {
+    pthread_mutex_lock(&prefetch_lock);
+    while (queue_head == queue_tail) {
+      pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+    }
+    prefetch_request_t request = queue[queue_head++ % PREFETCH_QUEUE_SIZE];
+    pthread_mutex_unlock(&prefetch_lock);
+
+    /* Blocks until the reads are issued, which is why it runs here. */
+    readahead(request.fd, request.offset, request.length);
+    close(request.fd);
+  }
+  return NULL;
+}
+
+void prefetch_start(void) {
+  pthread_t thread;
+  running = 1;
+  pthread_create(&thread, NULL, prefetch_worker, NULL);
+  pthread_detach(thread);
+}
+
+/* Queues a window, or drops it if the thread is behind: it is only a hint. */
+static void enqueue(int fd, off_t offset, size_t length) {
+  int copy = dup(fd);
+  if (copy < 0) return;
+  pthread_mutex_lock(&prefetch_lock);
+  if (queue_tail - queue_head < PREFETCH_QUEUE_SIZE) {
+    queue[queue_tail++ % PREFETCH_QUEUE_SIZE] =
+        (prefetch_request_t) {.fd = copy, .offset = offset, .length = length};
+    copy = -1;
+    pthread_cond_signal(&prefetch_cond);
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+  if (copy >= 0) close(copy);
+}
+
+void prefetch_open(int fd, off_t size) {
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  if (!running) return;
+  posix_fadvise(fd, 0, prefetch_window, POSIX_FADV_WILLNEED);
+  if (size > (off_t) prefetch_window) {
+    enqueue(fd, prefetch_window, PREFETCH_AHEAD * prefetch_window);
+  }
+}
+
+void prefetch_advance(int fd, off_t before, off_t after, off_t size) {
+  off_t window = after / prefetch_window;
+  off_t previous = before / prefetch_window;
+  if (window == previous) return;
+
+  /* Far enough ahead that the thread is not reading the very pages the
+   * worker is waiting for. */
+  off_t next = (previous + 1 + PREFETCH_AHEAD) * prefetch_window;
+  off_t end = (window + 1 + PREFETCH_AHEAD) * prefetch_window;
+  if (running && next < size) enqueue(fd, next, end - next);
+  if (prefetch_drop_behind && size >= prefetch_drop_behind) {
+    /* From the start each time: the kernel keeps any page cache folio that
+     * straddles the range, and readahead makes folios larger than a window.
+     * The part already dropped is cheap to skip. */
+    posix_fadvise(fd, 0, window * prefetch_window, POSIX_FADV_DONTNEED);
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef __PREFETCH__
+#define __PREFETCH__
+
+#include <sys/types.h>
+
+/* PREFETCH keeps large file transfers from stalling on page cache misses.
+ * While a worker sends one window of a file, a background thread pulls the
+ * next window into the page cache with readahead(), so the worker's reads
+ * find it there. For files too large to stay cached anyway, the pages
+ * already sent are dropped so that they do not push out the rest of the
+ * working set. */
+
+/* WINDOW is the number of bytes prefetched or dropped at a time (0 keeps
+ * the default of 1 MB). Files of at least DROP_BEHIND bytes (0 for never)
+ * are dropped from the page cache behind the send cursor. */
+void prefetch_init(size_t window, off_t drop_behind);
+
+/* Starts the prefetch thread; without it only the hints are given. Must
+ * run in the process that serves. */
+void prefetch_start(void);
+
+/* Tells the kernel FD (of SIZE bytes) is about to be read from the start
+ * and asks for its first window. */
+void prefetch_open(int fd, off_t size);
+
+/* Called after bytes BEFORE..AFTER of FD were sent. Whenever that crosses
+ * into a new window, queues the window after it and, if the file is huge,
+ * drops the pages already sent. */
+void prefetch_advance(int fd, off_t before, off_t after, off_t size);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Runs ./httpserver as a caching proxy in front of a fake upstream and
+ * checks what reaches the upstream. Run from this directory after make.
+ */
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TEST_PATH "/session"
+
+static int session_fetches;
+
+static int listen_on_any_port(int *port) {
+  struct sockaddr_in address = {.sin_family = AF_INET};
+  socklen_t length = sizeof(address);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  assert(bind(fd, (struct sockaddr *) &address, sizeof(address)) == 0);
+  assert(listen(fd, 64) == 0);
+  assert(getsockname(fd, (struct sockaddr *) &address, &length) == 0);
+  *port = ntohs(address.sin_port);
+  return fd;
+}
+
+static int connect_to(int port) {
+  struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port)};
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Reads until the peer closes or, with HEAD_ONLY, the head is complete. */
+static size_t read_message(int fd, char *buffer, size_t capacity, int head_only) {
+  size_t size = 0;
+  ssize_t got;
+  while (size + 1 < capacity && (got = read(fd, buffer + size, capacity - size - 1)) > 0) {
+    size += got;
+    buffer[size] = '\0';
+    if (head_only && strstr(buffer, "\r\n\r\n")) break;
+  }
+  buffer[size] = '\0';
+  return size;
+}
+
+/* Answers slowly, so that concurrent requests overlap in the proxy, with a
+ * response that is fresh for a minute but sets a cookie of its own. */
+static void *upstream_connection(void *arg) {
+  int fd = (int) (long) arg;
+  char request[8192];
+  read_message(fd, request, sizeof(request), 1);
+  int fetch = 0;
+  if (strncmp(request, "GET " TEST_PATH " ", strlen("GET " TEST_PATH " ")) == 0) {
+    fetch = __sync_add_and_fetch(&session_fetches, 1);
+  }
+  usleep(300 * 1000);
+  char response[256];
+  int size = snprintf(response, sizeof(response),
+      "HTTP/1.0 200 OK\r\nCache-Control: max-age=60\r\n"
+      "Set-Cookie: session=%d\r\nContent-Length: 2\r\n\r\nok", fetch);
+  write(fd, response, size);
+  close(fd);
+  return NULL;
+}
+
+static void *upstream(void *arg) {
+  int listen_fd = (int) (long) arg;
+  while (1) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+    pthread_t thread;
+    pthread_create(&thread, NULL, upstream_connection, (void *) (long) fd);
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+static int proxy_port;
+
+static void *client(void *arg) {
+  char *response = arg;
+  int fd = connect_to(proxy_port);
+  assert(fd >= 0);
+  char *request = "GET " TEST_PATH " HTTP/1.0\r\n\r\n";
+  write(fd, request, strlen(request));
+  read_message(fd, response, 1024, 0);
+  close(fd);
+  return NULL;
+}
+
+int main() {
+  int upstream_port;
+  int upstream_fd = listen_on_any_port(&upstream_port);
+  pthread_t thread;
+  pthread_create(&thread, NULL, upstream, (void *) (long) upstream_fd);
+
+  /* Borrow a free port for the proxy. */
+  close(listen_on_any_port(&proxy_port));
+  char upstream_arg[32], port_arg[16];
+  snprintf(upstream_arg, sizeof(upstream_arg), "127.0.0.1:%d", upstream_port);
+  snprintf(port_arg, sizeof(port_arg), "%d", proxy_port);
+  pid_t proxy = fork();
+  assert(proxy >= 0);
+  if (proxy == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);  // Even when an assertion fails.
+    execl("./httpserver", "httpserver", "--proxy", upstream_arg, "--port", port_arg,
+        "--num-threads", "4", "--proxy-cache", (char *) NULL);
+    perror("./httpserver");
+    _exit(1);
+  }
+  int fd, tries = 0;
+  while ((fd = connect_to(proxy_port)) < 0) {
+    assert(++tries < 100);
+    usleep(50 * 1000);
+  }
+  close(fd);
+
+  /* Concurrent GETs whose response sets a cookie each go upstream, and
+   * each client sees only its own cookie. */
+  static char responses[2][1024];
+  pthread_t clients[2];
+  for (int i = 0; i < 2; i++) {
+    pthread_create(&clients[i], NULL, client, responses[i]);
+    usleep(50 * 1000);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(clients[i], NULL);
+    assert(strstr(responses[i], " 200 ") && strstr(responses[i], "\r\n\r\nok"));
+  }
+  assert(session_fetches == 2);
+  assert(strstr(responses[0], "session=") && strstr(responses[1], "session="));
+  assert(strcmp(strstr(responses[0], "session="), strstr(responses[1], "session=")) != 0);
+
+  /* Nor is such a response cached for later clients. */
+  client(responses[0]);
+  assert(session_fetches == 3);
+
+  kill(proxy, SIGKILL);
+  waitpid(proxy, NULL, 0);
+  printf("proxy test successful!\n");
+  return 0;
+}
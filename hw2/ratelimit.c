@@ -0,0 +1,139 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "libhttp.h"
+#include "ratelimit.h"
+
+#define RATELIMIT_BUCKETS 4096
+#define RATELIMIT_WAYS 4         // Entries per bucket.
+#define RATELIMIT_STRIPES 64
+#define RATELIMIT_IDLE_MS 60000  // Quiet for this long, an entry is reusable.
+#define RATELIMIT_MAX_FDS (1 << 20)
+
+typedef struct client {
+  uint32_t ip;         // Network order; 0 marks an unused entry.
+  int active;
+  double tokens;
+  long last_ms;        // Last refill, also the last time it was seen.
+} client_t;
+
+static client_t table[RATELIMIT_BUCKETS][RATELIMIT_WAYS];
+static pthread_mutex_t stripes[RATELIMIT_STRIPES];
+static client_t **fd_clients;  // Entry counting each admitted fd.
+static int num_fds;
+static double refill_rate, burst_size;
+static int conns_limit;
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static unsigned int bucket_of(uint32_t ip) {
+  return (ip * 2654435761U) >> 20;  // Top 12 bits: RATELIMIT_BUCKETS.
+}
+
+void ratelimit_init(int rate, int burst, int max_conns) {
+  refill_rate = rate;
+  burst_size = burst > 0 ? burst : rate;
+  conns_limit = max_conns;
+  if (!ratelimit_enabled()) return;
+
+  for (int i = 0; i < RATELIMIT_STRIPES; i++) {
+    pthread_mutex_init(&stripes[i], NULL);
+  }
+  struct rlimit limit;
+  num_fds = RATELIMIT_MAX_FDS;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < RATELIMIT_MAX_FDS) {
+    num_fds = limit.rlim_cur;
+  }
+  fd_clients = calloc(num_fds, sizeof(client_t *));
+  if (!fd_clients) http_fatal_error("Malloc failed");
+}
+
+int ratelimit_enabled(void) {
+  return refill_rate > 0 || conns_limit > 0;
+}
+
+/* Finds the entry for IP in its bucket, taking over an unused or idle one
+ * if there is none. Caller holds the bucket's stripe. */
+static client_t *find_client(client_t *bucket, uint32_t ip, long now) {
+  client_t *victim = NULL;
+  for (int i = 0; i < RATELIMIT_WAYS; i++) {
+    if (bucket[i].ip == ip) return &bucket[i];
+    if (bucket[i].active == 0 && (bucket[i].ip == 0 ||
+          now - bucket[i].last_ms > RATELIMIT_IDLE_MS) &&
+        (!victim || bucket[i].last_ms < victim->last_ms)) {
+      victim = &bucket[i];
+    }
+  }
+  if (victim) {
+    victim->ip = ip;
+    victim->active = 0;
+    victim->tokens = burst_size;
+    victim->last_ms = now;
+  }
+  return victim;
+}
+
+int ratelimit_admit(int fd, struct sockaddr_in *address) {
+  uint32_t ip = address->sin_addr.s_addr;
+  if (ip == 0 || fd >= num_fds) return RATELIMIT_OK;
+
+  unsigned int index = bucket_of(ip);
+  pthread_mutex_t *stripe = &stripes[index % RATELIMIT_STRIPES];
+  long now = now_ms();
+  int verdict = RATELIMIT_OK;
+
+  pthread_mutex_lock(stripe);
+  client_t *client = find_client(table[index], ip, now);
+  if (client) {
+    if (refill_rate > 0) {
+      client->tokens += (now - client->last_ms) * refill_rate / 1000;
+      if (client->tokens > burst_size) client->tokens = burst_size;
+    }
+    client->last_ms = now;
+    if (conns_limit > 0 && client->active >= conns_limit) {
+      verdict = RATELIMIT_CONNS;
+    } else if (refill_rate > 0 && client->tokens < 1) {
+      verdict = RATELIMIT_RATE;
+    } else {
+      client->tokens -= 1;
+      client->active++;
+      fd_clients[fd] = client;
+    }
+  }
+  pthread_mutex_unlock(stripe);
+  return verdict;
+}
+
+void ratelimit_release(int fd) {
+  if (fd >= num_fds || !fd_clients[fd]) return;
+  client_t *client = fd_clients[fd];
+  fd_clients[fd] = NULL;
+  /* Entries never move, so the bucket follows from the address. */
+  unsigned int index = (client - &table[0][0]) / RATELIMIT_WAYS;
+  pthread_mutex_t *stripe = &stripes[index % RATELIMIT_STRIPES];
+  pthread_mutex_lock(stripe);
+  client->active--;
+  pthread_mutex_unlock(stripe);
+}
+
+void ratelimit_reject(int fd) {
+  static char response[] =
+    "HTTP/1.0 429 Too Many Requests\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+  char request[1024];
+  /* Unread request bytes would make close() send a reset that can beat
+   * the response to the client. */
+  recv(fd, request, sizeof(request), MSG_DONTWAIT);
+  send(fd, response, sizeof(response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
@@ -0,0 +1,32 @@
+#ifndef __RATELIMIT__
+#define __RATELIMIT__
+
+#include <netinet/in.h>
+
+/* RATELIMIT keeps one client address from monopolising the server. Each
+ * address gets a token bucket refilled at a fixed rate of connections per
+ * second and a cap on the connections it may have open at once. State
+ * lives in a fixed-size table with striped locks; entries of addresses
+ * that have gone quiet are reused for new ones, and when no entry is free
+ * the address is let through untracked. */
+
+#define RATELIMIT_OK 0
+#define RATELIMIT_RATE 1   // Out of tokens.
+#define RATELIMIT_CONNS 2  // Too many connections open.
+
+/* RATE connections per second with bursts of up to BURST, and at most
+ * MAX_CONNS open connections per address. A zero disables that limit. */
+void ratelimit_init(int rate, int burst, int max_conns);
+
+/* Non-zero if any limit is enabled. */
+int ratelimit_enabled(void);
+
+/* Decides whether the connection FD from ADDRESS may be served. On
+ * RATELIMIT_OK it counts as open until ratelimit_release(FD). */
+int ratelimit_admit(int fd, struct sockaddr_in *address);
+void ratelimit_release(int fd);
+
+/* Answers FD with a 429 without blocking, for use before closing it. */
+void ratelimit_reject(int fd);
+
+#endif
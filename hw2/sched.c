@@ -0,0 +1,62 @@
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "sched.h"
+
+#define SCHED_SLOTS 4096
+#define SCHED_PEEK_SIZE 512
+
+typedef struct size_hint {
+  unsigned long hash;  // 0 marks an empty slot.
+  long size;
+} size_hint_t;
+
+/* A direct-mapped table: a colliding path simply replaces the old hint. */
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_hint_t hints[SCHED_SLOTS];
+static long threshold;
+
+static unsigned long hash_path(char *path, size_t len) {
+  unsigned long hash = 14695981039346656037UL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) path[i];
+    hash *= 1099511628211UL;
+  }
+  return hash ? hash : 1;
+}
+
+void sched_init(long large_threshold) {
+  threshold = large_threshold;
+}
+
+void sched_record(char *path, long size) {
+  unsigned long hash = hash_path(path, strlen(path));
+  pthread_mutex_lock(&sched_lock);
+  hints[hash % SCHED_SLOTS].hash = hash;
+  hints[hash % SCHED_SLOTS].size = size;
+  pthread_mutex_unlock(&sched_lock);
+}
+
+int sched_classify(int fd) {
+  char request[SCHED_PEEK_SIZE + 1];
+  ssize_t size = recv(fd, request, SCHED_PEEK_SIZE, MSG_PEEK | MSG_DONTWAIT);
+  if (size <= 0) return SCHED_UNKNOWN;
+  request[size] = '\0';
+
+  char *path = strchr(request, ' ');
+  if (!path) return SCHED_UNKNOWN;
+  path++;
+  size_t len = strcspn(path, " \r\n");
+  if (path[len] == '\0') return SCHED_UNKNOWN;  // Truncated request line.
+
+  unsigned long hash = hash_path(path, len);
+  int class = SCHED_UNKNOWN;
+  pthread_mutex_lock(&sched_lock);
+  if (hints[hash % SCHED_SLOTS].hash == hash) {
+    long hint = hints[hash % SCHED_SLOTS].size;
+    class = hint == SCHED_SLOW || hint >= threshold ? SCHED_LARGE : SCHED_SMALL;
+  }
+  pthread_mutex_unlock(&sched_lock);
+  return class;
+}
@@ -0,0 +1,26 @@
+#ifndef __SCHED__
+#define __SCHED__
+
+/* SCHED sorts accepted connections by how long they are likely to keep a
+ * worker busy, so that a few large downloads cannot delay the many small
+ * requests queued behind them. The acceptor peeks at the request line
+ * (already in the socket thanks to TCP_DEFER_ACCEPT) and looks the path up
+ * in a table of response sizes recorded by earlier requests. */
+
+#define SCHED_SMALL 0    // Known to be small: fast lane.
+#define SCHED_UNKNOWN 1  // Not seen yet: slow lane, starvation protected.
+#define SCHED_LARGE 2    // Known to be large or slow: separate pool.
+
+/* Sentinel size for responses that are slow for reasons other than their
+ * size, e.g. ones that had to be fetched from a proxy target. */
+#define SCHED_SLOW -1
+
+void sched_init(long large_threshold);
+
+/* Remembers that the response for PATH was SIZE bytes (or SCHED_SLOW). */
+void sched_record(char *path, long size);
+
+/* Classifies the request waiting on FD without consuming it. */
+int sched_classify(int fd);
+
+#endif
@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+#include "trace.h"
+
+#define TRACE_RING_SIZE 4096
+#define TRACE_PATH_SIZE 64
+#define TRACE_MAX_FDS (1 << 20)
+
+typedef struct trace_record {
+  int sampled;
+  int fd;
+  long stamps[TRACE_PHASES];  // Microseconds, 0 when not reached.
+  char path[TRACE_PATH_SIZE];
+} trace_record_t;
+
+typedef struct trace_ring {
+  pthread_mutex_t lock;  // Only ever contended by a dump.
+  int tid;
+  unsigned long count;   // Records ever added.
+  trace_record_t records[TRACE_RING_SIZE];
+  struct trace_ring *next;
+} trace_ring_t;
+
+/* Each span is named for what happened up to the phase it ends at. */
+static char *span_names[TRACE_PHASES] = {
+  NULL, "dispatch", "queue", "parse", "resolve", "respond", "send",
+};
+
+static int sample_every;
+static char *dump_path;
+static unsigned int next_sample;
+static trace_record_t *in_progress;  // Indexed by fd.
+static int num_fds;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *rings;
+static int num_rings;
+static __thread trace_ring_t *thread_ring;
+
+static long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void trace_init(int sample, char *path) {
+  sample_every = sample;
+  dump_path = path;
+  if (!sample_every) return;
+
+  struct rlimit limit;
+  num_fds = TRACE_MAX_FDS;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < TRACE_MAX_FDS) {
+    num_fds = limit.rlim_cur;
+  }
+  in_progress = calloc(num_fds, sizeof(trace_record_t));
+  if (!in_progress) http_fatal_error("Malloc failed");
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+int trace_enabled(void) {
+  return sample_every > 0;
+}
+
+void trace_begin(int fd) {
+  if (!sample_every || fd >= num_fds) return;
+  trace_record_t *record = &in_progress[fd];
+  record->sampled = __sync_fetch_and_add(&next_sample, 1) % sample_every == 0;
+  if (!record->sampled) return;
+  memset(record->stamps, 0, sizeof(record->stamps));
+  record->path[0] = '\0';
+  record->fd = fd;
+  record->stamps[TRACE_ACCEPT] = now_us();
+}
+
+void trace_mark(int fd, int phase) {
+  if (!sample_every || fd >= num_fds || !in_progress[fd].sampled) return;
+  if (!in_progress[fd].stamps[phase]) in_progress[fd].stamps[phase] = now_us();
+}
+
+void trace_path(int fd, char *path) {
+  if (!sample_every || fd >= num_fds || !in_progress[fd].sampled) return;
+  snprintf(in_progress[fd].path, TRACE_PATH_SIZE, "%s", path);
+}
+
+void trace_end(int fd) {
+  if (!sample_every || fd >= num_fds || !in_progress[fd].sampled) return;
+  trace_record_t *record = &in_progress[fd];
+  record->stamps[TRACE_LAST_BYTE] = now_us();
+  record->sampled = 0;
+
+  if (!thread_ring) {
+    thread_ring = calloc(1, sizeof(trace_ring_t));
+    if (!thread_ring) http_fatal_error("Malloc failed");
+    pthread_mutex_init(&thread_ring->lock, NULL);
+    pthread_mutex_lock(&rings_lock);
+    thread_ring->tid = ++num_rings;
+    thread_ring->next = rings;
+    rings = thread_ring;
+    pthread_mutex_unlock(&rings_lock);
+  }
+  pthread_mutex_lock(&thread_ring->lock);
+  thread_ring->records[thread_ring->count++ % TRACE_RING_SIZE] = *record;
+  pthread_mutex_unlock(&thread_ring->lock);
+}
+
+/* One complete event per phase, spanning from the previous stamp. */
+static void dump_record(FILE *file, trace_record_t *record, int tid, int *first) {
+  int previous = -1;
+  for (int phase = 0; phase < TRACE_PHASES; phase++) {
+    if (!record->stamps[phase]) continue;
+    if (previous >= 0) {
+      fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\","
+          "\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d,"
+          "\"args\":{\"fd\":%d,\"path\":\"", *first ? "" : ",", span_names[phase],
+          record->stamps[previous], record->stamps[phase] - record->stamps[previous],
+          (int) getpid(), tid, record->fd);
+      for (char *c = record->path; *c; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', file);
+        if ((unsigned char) *c >= 0x20) fputc(*c, file);
+      }
+      fprintf(file, "\"}}");
+      *first = 0;
+    }
+    previous = phase;
+  }
+}
+
+static void dump(void) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.%d", dump_path, (int) getpid());
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror("Failed to open trace file");
+    return;
+  }
+
+  int first = 1, dumped = 0;
+  fprintf(file, "{\"traceEvents\":[");
+  pthread_mutex_lock(&rings_lock);
+  for (trace_ring_t *ring = rings; ring; ring = ring->next) {
+    pthread_mutex_lock(&ring->lock);
+    unsigned long start = ring->count > TRACE_RING_SIZE ? ring->count - TRACE_RING_SIZE : 0;
+    for (unsigned long i = start; i < ring->count; i++) {
+      dump_record(file, &ring->records[i % TRACE_RING_SIZE], ring->tid, &first);
+      dumped++;
+    }
+    pthread_mutex_unlock(&ring->lock);
+  }
+  pthread_mutex_unlock(&rings_lock);
+  fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(file);
+  fprintf(stderr, "Wrote %d traced requests to %s\n", dumped, path);
+}
+
+static void *trace_dump_worker(void *arg) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  while (1) {
+    int signum;
+    if (sigwait(&set, &signum) == 0) dump();
+  }
+  return NULL;
+}
+
+void trace_start(void) {
+  if (!sample_every) return;
+  pthread_t thread;
+  pthread_create(&thread, NULL, trace_dump_worker, NULL);
+  pthread_detach(thread);
+}
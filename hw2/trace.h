@@ -0,0 +1,42 @@
+#ifndef __TRACE__
+#define __TRACE__
+
+/* TRACE records when a sample of requests passes each phase of its life,
+ * to tell where the time of a slow request went. Records in progress are
+ * kept per connection fd; finished ones go to a ring buffer owned by the
+ * thread that finished them. On SIGUSR1 the rings are written out in the
+ * Chrome trace event format, for chrome://tracing or Perfetto. */
+
+#define TRACE_ACCEPT 0
+#define TRACE_ENQUEUE 1
+#define TRACE_DEQUEUE 2
+#define TRACE_PARSED 3
+#define TRACE_RESOLVED 4     // The file or upstream to answer from is known.
+#define TRACE_FIRST_BYTE 5
+#define TRACE_LAST_BYTE 6
+#define TRACE_PHASES 7
+
+/* Traces one in every SAMPLE connections (0 disables tracing) and dumps
+ * to PATH, suffixed with the pid. SIGUSR1 must be blocked in every thread
+ * before any is created, so that only the dump thread takes it. */
+void trace_init(int sample, char *path);
+
+/* Starts the thread that waits for SIGUSR1. Must run in the process that
+ * serves. */
+void trace_start(void);
+
+int trace_enabled(void);
+
+/* Decides whether the connection just accepted on FD is traced. */
+void trace_begin(int fd);
+
+/* Stamps PHASE for FD if it is traced and PHASE is not stamped yet. */
+void trace_mark(int fd, int phase);
+
+/* Remembers the request path of FD for the dump. */
+void trace_path(int fd, char *path);
+
+/* Stamps the last byte and moves the record of FD to this thread's ring. */
+void trace_end(int fd);
+
+#endif
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "upstream.h"
+
+#define UPSTREAM_MAX 64
+#define UPSTREAM_VNODES 64
+#define CONNECT_TIMEOUT_MS 2000
+#define HEALTH_TIMEOUT_MS 2000
+#define EJECT_SECONDS 10
+
+typedef struct ring_point {
+  unsigned long hash;
+  int index;
+} ring_point_t;
+
+static pthread_mutex_t upstream_lock = PTHREAD_MUTEX_INITIALIZER;
+static upstream_t upstreams[UPSTREAM_MAX];
+static int num_upstreams;
+static int lb_policy;
+static unsigned int next_round_robin;
+static ring_point_t ring[UPSTREAM_MAX * UPSTREAM_VNODES];
+static int ring_size;
+static char *health_path;
+static int health_interval;
+
+static unsigned long hash_string(char *key) {
+  unsigned long hash = 14695981039346656037UL;
+  while (*key) {
+    hash ^= (unsigned char) *key++;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static int compare_ring_points(const void *a, const void *b) {
+  unsigned long x = ((ring_point_t *) a)->hash, y = ((ring_point_t *) b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+void upstream_init(char *targets, int policy) {
+  lb_policy = policy;
+  char *saveptr;
+  for (char *target = strtok_r(targets, ",", &saveptr); target;
+      target = strtok_r(NULL, ",", &saveptr)) {
+    if (num_upstreams == UPSTREAM_MAX) {
+      fprintf(stderr, "At most %d proxy targets are supported\n", UPSTREAM_MAX);
+      exit(EINVAL);
+    }
+    upstream_t *upstream = &upstreams[num_upstreams];
+    char *colon_pointer = strchr(target, ':');
+    if (colon_pointer != NULL) {
+      *colon_pointer = '\0';
+      upstream->port = atoi(colon_pointer + 1);
+    } else {
+      upstream->port = 80;
+    }
+    upstream->hostname = target;
+
+    struct hostent *target_dns_entry = gethostbyname2(target, AF_INET);
+    if (target_dns_entry == NULL) {
+      fprintf(stderr, "Cannot find host: %s\n", target);
+      exit(ENXIO);
+    }
+    upstream->address.sin_family = AF_INET;
+    upstream->address.sin_port = htons(upstream->port);
+    memcpy(&upstream->address.sin_addr, target_dns_entry->h_addr_list[0],
+        sizeof(upstream->address.sin_addr));
+    upstream->healthy = 1;
+
+    for (int i = 0; i < UPSTREAM_VNODES; i++) {
+      char vnode[512];
+      snprintf(vnode, sizeof(vnode), "%s:%d#%d", target, upstream->port, i);
+      ring[ring_size].hash = hash_string(vnode);
+      ring[ring_size].index = num_upstreams;
+      ring_size++;
+    }
+    num_upstreams++;
+  }
+  if (num_upstreams == 0) {
+    fprintf(stderr, "Expected at least one proxy target\n");
+    exit(EINVAL);
+  }
+  qsort(ring, ring_size, sizeof(ring_point_t), compare_ring_points);
+}
+
+static int available(int i, time_t now) {
+  return upstreams[i].healthy && upstreams[i].ejected_until <= now;
+}
+
+/* Picks the next target not yet in TRIED, preferring available ones.
+ * Caller holds upstream_lock. */
+static int choose(char *key, char *tried, time_t now) {
+  int pass, i, best = -1;
+  for (pass = 0; pass < 2 && best < 0; pass++) {
+    /* The second pass ignores health so that we still try something when
+     * every target looks down. */
+    if (lb_policy == LB_HASH && key) {
+      unsigned long hash = hash_string(key);
+      int lo = 0, hi = ring_size;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < hash) lo = mid + 1; else hi = mid;
+      }
+      for (i = 0; i < ring_size && best < 0; i++) {
+        int index = ring[(lo + i) % ring_size].index;
+        if (!tried[index] && (pass || available(index, now))) best = index;
+      }
+    } else {
+      unsigned int start = next_round_robin++;
+      for (i = 0; i < num_upstreams; i++) {
+        int index = (start + i) % num_upstreams;
+        if (tried[index] || !(pass || available(index, now))) continue;
+        if (best < 0 || (lb_policy == LB_LEAST_CONN &&
+              upstreams[index].active < upstreams[best].active)) {
+          best = index;
+        }
+        if (lb_policy != LB_LEAST_CONN) break;
+      }
+    }
+  }
+  return best;
+}
+
+/* Connects to ADDRESS, giving up after TIMEOUT_MS. Returns the socket or
+ * -1; it is left non-blocking when called from a coroutine and blocking
+ * otherwise. */
+static int connect_with_timeout(struct sockaddr_in *address, int timeout_ms) {
+  int fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    perror("Failed to create a new socket");
+    return -1;
+  }
+  int flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  if (connect(fd, (struct sockaddr *) address, sizeof(*address)) < 0) {
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    if (errno != EINPROGRESS || coro_poll(fd, POLLOUT, timeout_ms) != 1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0 || error) {
+      close(fd);
+      return -1;
+    }
+  }
+  if (!coro_active()) fcntl(fd, F_SETFL, flags);
+  return fd;
+}
+
+int upstream_connect(char *key, upstream_t **chosen) {
+  char tried[UPSTREAM_MAX] = {0};
+  int attempt;
+  for (attempt = 0; attempt < num_upstreams; attempt++) {
+    pthread_mutex_lock(&upstream_lock);
+    int index = choose(key, tried, time(NULL));
+    upstreams[index].active++;
+    pthread_mutex_unlock(&upstream_lock);
+
+    tried[index] = 1;
+    int fd = connect_with_timeout(&upstreams[index].address, CONNECT_TIMEOUT_MS);
+    if (fd >= 0) {
+      *chosen = &upstreams[index];
+      return fd;
+    }
+
+    fprintf(stderr, "Ejecting proxy target %s:%d\n", upstreams[index].hostname,
+        upstreams[index].port);
+    pthread_mutex_lock(&upstream_lock);
+    upstreams[index].active--;
+    upstreams[index].ejected_until = time(NULL) + EJECT_SECONDS;
+    pthread_mutex_unlock(&upstream_lock);
+  }
+  return -1;
+}
+
+void upstream_release(upstream_t *upstream) {
+  pthread_mutex_lock(&upstream_lock);
+  upstream->active--;
+  pthread_mutex_unlock(&upstream_lock);
+}
+
+static int health_check(upstream_t *upstream) {
+  int fd = connect_with_timeout(&upstream->address, HEALTH_TIMEOUT_MS);
+  if (fd < 0) return 0;
+
+  dprintf(fd, "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",
+      health_path, upstream->hostname);
+  char status_line[64] = {0};
+  size_t total = 0;
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  while (total < sizeof(status_line) - 1 && !strchr(status_line, '\n') &&
+      poll(&pfd, 1, HEALTH_TIMEOUT_MS) == 1) {
+    ssize_t size = read(fd, status_line + total, sizeof(status_line) - 1 - total);
+    if (size <= 0) break;
+    total += size;
+  }
+  close(fd);
+
+  int status = 0;
+  sscanf(status_line, "HTTP/%*s %d", &status);
+  return status >= 100 && status < 500;
+}
+
+static void *health_check_worker(void *arg) {
+  while (1) {
+    for (int i = 0; i < num_upstreams; i++) {
+      int healthy = health_check(&upstreams[i]);
+      pthread_mutex_lock(&upstream_lock);
+      if (healthy != upstreams[i].healthy) {
+        fprintf(stderr, "Proxy target %s:%d is %s\n", upstreams[i].hostname,
+            upstreams[i].port, healthy ? "up" : "down");
+      }
+      upstreams[i].healthy = healthy;
+      if (healthy) upstreams[i].ejected_until = 0;
+      pthread_mutex_unlock(&upstream_lock);
+    }
+    sleep(health_interval);
+  }
+  return NULL;
+}
+
+void upstream_start_health_checks(int interval, char *path) {
+  pthread_t thread;
+  health_interval = interval;
+  health_path = path;
+  pthread_create(&thread, NULL, health_check_worker, NULL);
+  pthread_detach(thread);
+}
@@ -0,0 +1,39 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+#include <netinet/in.h>
+#include <time.h>
+
+/* UPSTREAM keeps the set of proxy targets behind the server and picks one
+ * for each proxied connection. Targets that refuse connections or fail the
+ * periodic health check are taken out of rotation for a while. */
+
+#define LB_ROUND_ROBIN 0
+#define LB_LEAST_CONN 1
+#define LB_HASH 2
+
+typedef struct upstream {
+  char *hostname;
+  int port;
+  struct sockaddr_in address;  // Resolved once at startup.
+  int active;                  // Connections currently open to it.
+  int healthy;                 // Result of the last health check.
+  time_t ejected_until;        // Skipped after a failed connect until then.
+} upstream_t;
+
+/* Parses a comma separated "host:port,host:port" list. Exits on bad input. */
+void upstream_init(char *targets, int policy);
+
+/* Connects to a target chosen by the balancing policy, trying the others
+ * when it fails. KEY selects the target under LB_HASH. Returns the socket
+ * and stores the target in *chosen, or returns -1 if none answered. */
+int upstream_connect(char *key, upstream_t **chosen);
+
+/* Must be called once the connection from upstream_connect() is closed. */
+void upstream_release(upstream_t *upstream);
+
+/* Starts a thread that sends "GET PATH" to every target each INTERVAL
+ * seconds and marks it healthy when it answers with a non-5xx status. */
+void upstream_start_health_checks(int interval, char *path);
+
+#endif
@@ -4,36 +4,85 @@
 
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
-
-  /* TODO: Make me thread-safe! */
   pthread_mutex_init(&wq->lock, NULL);
   pthread_cond_init(&wq->cond, NULL);
   wq->size = 0;
-  wq->head = NULL;
+  for (int lane = 0; lane < WQ_LANES; lane++) {
+    wq->lanes[lane] = NULL;
+  }
+  wq->fast_streak = 0;
+  wq->free_items = NULL;
 }
 
 /* Remove an item from the WQ. This function should block until there
  * is at least one item on the queue. */
 int wq_pop(wq_t *wq) {
+  pthread_mutex_lock(&wq->lock);
+  while (wq->size == 0) {
+    pthread_cond_wait(&wq->cond, &wq->lock);
+  }
 
-  /* TODO: Make me blocking and thread-safe! */
+  int lane = WQ_LANE_FAST;
+  if (!wq->lanes[WQ_LANE_FAST] || wq->fast_streak >= WQ_STARVATION_LIMIT) {
+    lane = WQ_LANE_SLOW;
+  }
+  /* Only count fast pops that made a slow-lane socket wait. */
+  if (lane == WQ_LANE_FAST && wq->lanes[WQ_LANE_SLOW]) {
+    wq->fast_streak++;
+  } else {
+    wq->fast_streak = 0;
+  }
 
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
+  wq_item_t *wq_item = wq->lanes[lane];
+  int client_socket_fd = wq_item->client_socket_fd;
   wq->size--;
-  DL_DELETE(wq->head, wq->head);
+  DL_DELETE(wq->lanes[lane], wq_item);
+  LL_PREPEND(wq->free_items, wq_item);
+  pthread_mutex_unlock(&wq->lock);
 
-  free(wq_item);
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
+/* Add ITEM to the fast lane of WQ. */
 void wq_push(wq_t *wq, int client_socket_fd) {
+  wq_push_lane(wq, client_socket_fd, WQ_LANE_FAST);
+}
 
-  /* TODO: Make me thread-safe! */
-
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
+/* Add ITEM to the given lane of WQ. */
+void wq_push_lane(wq_t *wq, int client_socket_fd, int lane) {
+  pthread_mutex_lock(&wq->lock);
+  wq_item_t *wq_item = wq->free_items;
+  if (wq_item) {
+    LL_DELETE(wq->free_items, wq_item);
+  } else {
+    wq_item = calloc(1, sizeof(wq_item_t));
+  }
   wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
+  DL_APPEND(wq->lanes[lane], wq_item);
   wq->size++;
+  pthread_cond_signal(&wq->cond);
+  pthread_mutex_unlock(&wq->lock);
+}
+
+/* Add COUNT sockets to the fast lane of WQ at once, taking the lock a
+ * single time. */
+void wq_push_batch(wq_t *wq, int *client_socket_fds, int count) {
+  pthread_mutex_lock(&wq->lock);
+  for (int i = 0; i < count; i++) {
+    wq_item_t *wq_item = wq->free_items;
+    if (wq_item) {
+      LL_DELETE(wq->free_items, wq_item);
+    } else {
+      wq_item = calloc(1, sizeof(wq_item_t));
+    }
+    wq_item->client_socket_fd = client_socket_fds[i];
+    DL_APPEND(wq->lanes[WQ_LANE_FAST], wq_item);
+  }
+  wq->size += count;
+  if (count == 1) {
+    pthread_cond_signal(&wq->cond);
+  } else {
+    pthread_cond_broadcast(&wq->cond);
+  }
+  pthread_mutex_unlock(&wq->lock);
 }
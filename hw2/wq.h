@@ -4,7 +4,14 @@
 #include <pthread.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served. Sockets wait in one of WQ_LANES lanes: wq_pop() takes
+ * from the fast lane first, but never passes over a waiting slow-lane socket
+ * more than WQ_STARVATION_LIMIT times in a row. */
+
+#define WQ_LANE_FAST 0
+#define WQ_LANE_SLOW 1
+#define WQ_LANES 2
+#define WQ_STARVATION_LIMIT 8
 
 typedef struct wq_item {
   int client_socket_fd; // Client socket to be served.
@@ -14,14 +21,17 @@ typedef struct wq_item {
 
 typedef struct wq {
   int size;
-  wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
+  wq_item_t *lanes[WQ_LANES];
+  int fast_streak;        // Fast pops since the slow lane was last served.
+  wq_item_t *free_items;  // Popped items kept for reuse by wq_push.
   pthread_mutex_t lock;
   pthread_cond_t cond;
 } wq_t;
 
 void wq_init(wq_t *wq);
 void wq_push(wq_t *wq, int client_socket_fd);
+void wq_push_lane(wq_t *wq, int client_socket_fd, int lane);
+void wq_push_batch(wq_t *wq, int *client_socket_fds, int count);
 int wq_pop(wq_t *wq);
 
 #endif
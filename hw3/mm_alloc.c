@@ -1,131 +1,1731 @@
 /*
  * mm_alloc.c
  *
- * Stub implementations of the mm_* routines.
+ * A malloc clone on top of sbrk. Blocks sit back to back in address
+ * order, each behind a one-word header with its size and two flags:
+ * whether it is free and whether the block before it is. A free block
+ * repeats its size in its last word, so mm_free can step to either
+ * neighbour and coalesce with it; blocks in use need nothing but the
+ * header. Each contiguous stretch of heap ends in an epilogue, a header of
+ * size zero marked in use, so that nothing merges past its end. Free
+ * blocks are also kept in segregated free lists, one per power-of-two
+ * size class, and the large ones in a tree ordered by size, so that
+ * allocation never walks the blocks in use and large requests get the
+ * best fit.
+ *
+ * All of that is shared and guarded by heap_lock. Objects of up to
+ * SLAB_MAX_SIZE bytes do not use it at all: they come from slabs, pages
+ * carved into objects of one size with no header of their own, taken from
+ * a region reserved up front so that mm_free can tell them apart by
+ * address. In front of both, every thread keeps a cache of small objects,
+ * one stack per size, that it refills from and flushes to the slabs or
+ * the heap in batches; most malloc/free pairs never take a lock. A cached
+ * object still counts as in use below, and any thread may free any
+ * object: it simply goes to the freeing thread's cache.
+ *
+ * Blocks above the mmap threshold bypass all of this and get a mapping of
+ * their own, which mm_free unmaps and mm_realloc resizes with mremap. When
+ * the block at the top of the sbrk heap ends up free and large, the break
+ * is moved back down over it, so memory from a burst goes back to the OS.
  */
 
+#define _GNU_SOURCE
 #include "mm_alloc.h"
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-#define BLOCKSIZE sizeof(block_t)
+#define HEADER_SIZE sizeof(size_t)
+/* Payload alignment, and the granularity of block sizes. */
+#define ALIGNMENT 16
+/* A free block holds a header, two free list links and a footer. */
+#define MIN_BLOCK 32
+/* Flags in the low bits of a block header. */
+#define BLOCK_FREE 1
+#define PREV_FREE 2
+#define BLOCK_MMAPPED 4
+/* In use and sampled by the heap profiler. */
+#define BLOCK_SAMPLED 8
+#define FLAGS (ALIGNMENT - 1)
+/* Free blocks of less than TREE_MIN_SIZE bytes are kept in NUM_CLASSES
+ * free lists, larger ones in TREE_BINS trees ordered by size. */
+#define NUM_CLASSES 10
+#define TREE_MIN_SIZE ((size_t) 1 << NUM_CLASSES)
+#define TREE_BINS 64
+/* Free blocks tried in the request's own class before moving up. */
+#define CLASS_SCAN_LIMIT 8
+/* Objects of up to SLAB_MAX_SIZE bytes live in slabs of SLAB_SIZE bytes,
+ * carved out of a reserved region of SLAB_REGION bytes. */
+#define SLAB_MAX_SIZE 256
+#define SLAB_SIZE 4096
+#define SLAB_REGION ((size_t) 1 << 32)
+#define SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+/* Thread caches hold slab objects and heap blocks of up to CACHE_MAX_SIZE
+ * bytes, at most CACHE_LIMIT of each size, and move CACHE_BATCH at a
+ * time. */
+#define CACHE_MAX_SIZE 512
+#define CACHE_BINS (CACHE_MAX_SIZE / ALIGNMENT)
+#define CACHE_LIMIT 64
+#define CACHE_BATCH 32
+#define DEFAULT_MMAP_THRESHOLD (128 * 1024)
+/* A free block at the top of the heap is given back once this large. */
+#define TRIM_THRESHOLD (128 * 1024)
+/* Growing the last block in place moves the break by at least this much. */
+#define TOP_PAD (32 * 1024)
 
-block_t* first = NULL;
-block_t* last = NULL;
+/* Just past the epilogue of the stretch of heap sbrk last extended. */
+static char* heap_end;
 
-void *mm_malloc(size_t size) {
-    if (!size) {
-        return NULL;
+/* free_lists[i] holds free blocks of 2^i to 2^(i+1) - 1 bytes; bit i of
+ * nonempty_classes is set while it has any. */
+static block_t* free_lists[NUM_CLASSES];
+static unsigned int nonempty_classes;
+
+/*
+ * A free block of at least TREE_MIN_SIZE bytes. It has the layout of a
+ * block_t, but uses the free list links as children in a treap ordered by
+ * size and then address. Priorities are hashed from addresses, so they
+ * need no room and the tree stays balanced whatever order blocks come and
+ * go in.
+ */
+typedef struct tree_node {
+    size_t header;
+    struct tree_node* left;
+    struct tree_node* right;
+} tree_node_t;
+
+/* free_trees[i] holds the large free blocks of tree bin i, two bins to a
+ * power of two; bit i of nonempty_trees is set while it has any. Small
+ * trees mean short walks through blocks that are mostly not in cache. */
+static tree_node_t* free_trees[TREE_BINS];
+static uint64_t nonempty_trees;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+static size_t page_size;
+
+/* Counters behind mm_stats. The heap ones are guarded by heap_lock, the
+ * slab one by slab_lock; mappings are made without a lock, so theirs are
+ * updated atomically. */
+static size_t heap_bytes;
+static size_t heap_peak;
+static size_t free_blocks;
+static size_t free_bytes;
+static size_t mapped_blocks;
+static size_t mapped_bytes;
+static size_t slab_used_bytes;
+
+/*
+ * The header at the start of every slab. Objects that were handed out and
+ * freed again are linked through their first word; those past unused
+ * never were. Slabs with free objects are on the partial list of their
+ * size, empty ones on empty_slabs, full ones on no list at all.
+ */
+typedef struct slab {
+    struct slab* next;
+    struct slab* pre;
+    void* free;
+    char* unused;
+    size_t size;
+    int used;
+    int capacity;
+} slab_t;
+
+#define SLAB_HEADER ((sizeof(slab_t) + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1))
+
+/* An empty slab kept resident to remember slabs whose pages were given
+ * back, which cannot hold a list link themselves. */
+typedef struct slab_index {
+    struct slab_index* next;
+    size_t count;
+    slab_t* slabs[(SLAB_SIZE - 2 * sizeof(size_t)) / sizeof(slab_t*)];
+} slab_index_t;
+
+static char* slab_base;
+static char* slab_top;
+static slab_t* partial_slabs[SLAB_CLASSES];
+static slab_t* empty_slabs;
+static slab_index_t* released_slabs;
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+/* Objects of (i + 1) * ALIGNMENT bytes: slab objects up to SLAB_MAX_SIZE,
+ * payloads of heap blocks of that size above it. Linked through their
+ * first word. Each thread also counts its own requests by size, so that
+ * counting costs no more than an increment, and the bytes left before the
+ * heap profiler samples its next request. */
+typedef struct thread_cache {
+    void* bins[CACHE_BINS];
+    int counts[CACHE_BINS];
+    size_t requests[MM_STATS_BUCKETS];
+    size_t sample_left;
+    uint64_t sample_seed;
+    struct thread_cache* next;
+} thread_cache_t;
+
+/* Initial-exec, so that reaching them costs no call to __tls_get_addr
+ * on every malloc and free. */
+#define TLS_MODEL __attribute__((tls_model("initial-exec")))
+static __thread thread_cache_t cache TLS_MODEL;
+static __thread int cache_registered TLS_MODEL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/* The caches of live threads, and the requests of threads gone. */
+static thread_cache_t* caches;
+static size_t exited_requests[MM_STATS_BUCKETS];
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t block_size(block_t* block) {
+    return block->header & ~(size_t) FLAGS;
+}
+
+static void* payload(block_t* block) {
+    return (char*) block + HEADER_SIZE;
+}
+
+static block_t* block_of(void* ptr) {
+    return (block_t*) ((char*) ptr - HEADER_SIZE);
+}
+
+static block_t* next_block(block_t* block) {
+    return (block_t*) ((char*) block + block_size(block));
+}
+
+/* Only valid when the block before is free, and so has a footer. */
+static block_t* prev_block(block_t* block) {
+    return (block_t*) ((char*) block - ((size_t*) block)[-1]);
+}
+
+static void set_footer(block_t* block) {
+    ((size_t*) next_block(block))[-1] = block_size(block);
+}
+
+/* Size of the block that holds size bytes of payload, or 0 if there can
+ * be no such block. */
+static size_t request_size(size_t size) {
+    if (size > SIZE_MAX / 2) {
+        return 0;
     }
-    if (!first) {
-        block_t* tmp_alloc = sbrk(BLOCKSIZE + size);
-        if (tmp_alloc == (void*) -1) {
-            perror("Error allocate new block with sbrk.");
-            return NULL;
+    size = (size + HEADER_SIZE + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+    return size < MIN_BLOCK ? MIN_BLOCK : size;
+}
+
+static uintptr_t page_align(uintptr_t n) {
+    if (!page_size) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    return (n + page_size - 1) & ~(page_size - 1);
+}
+
+static int size_class(size_t size) {
+    int class = 0;
+    while (size >>= 1) {
+        class++;
+    }
+    return class;
+}
+
+/* The tree bin of blocks of size bytes: the lower or upper half of their
+ * size class. */
+static int tree_bin(size_t size) {
+    int class = size_class(size);
+    int bin = 2 * (class - NUM_CLASSES) + (int) ((size >> (class - 1)) & 1);
+    return bin < TREE_BINS ? bin : TREE_BINS - 1;
+}
+
+static size_t node_size(tree_node_t* node) {
+    return node->header & ~(size_t) FLAGS;
+}
+
+static uintptr_t priority(tree_node_t* node) {
+    return ((uintptr_t) node >> 4) * 0x9e3779b97f4a7c15;
+}
+
+/* Whether a comes before b: smaller blocks first, then lower addresses. */
+static int tree_less(tree_node_t* a, tree_node_t* b) {
+    return node_size(a) < node_size(b) || (node_size(a) == node_size(b) && a < b);
+}
+
+/* Splits the tree at root into the nodes before key and those after. */
+static void tree_split(tree_node_t* root, tree_node_t* key, tree_node_t** before,
+                       tree_node_t** after) {
+    if (!root) {
+        *before = *after = NULL;
+    } else if (tree_less(root, key)) {
+        *before = root;
+        tree_split(root->right, key, &root->right, after);
+    } else {
+        *after = root;
+        tree_split(root->left, key, before, &root->left);
+    }
+}
+
+/* Joins two trees, every node of before coming before every node of
+ * after. */
+static tree_node_t* tree_merge(tree_node_t* before, tree_node_t* after) {
+    if (!before || !after) {
+        return before ? before : after;
+    }
+    if (priority(before) > priority(after)) {
+        before->right = tree_merge(before->right, after);
+        return before;
+    }
+    after->left = tree_merge(before, after->left);
+    return after;
+}
+
+static void tree_insert(tree_node_t** link, tree_node_t* node) {
+    while (*link && priority(*link) > priority(node)) {
+        link = tree_less(node, *link) ? &(*link)->left : &(*link)->right;
+    }
+    tree_split(*link, node, &node->left, &node->right);
+    *link = node;
+}
+
+/* The link to node, in the tree whose root is at link. */
+static tree_node_t** tree_find(tree_node_t** link, tree_node_t* node) {
+    while (*link != node) {
+        link = tree_less(node, *link) ? &(*link)->left : &(*link)->right;
+    }
+    return link;
+}
+
+/* Takes the node at link out of the tree. */
+static void tree_unlink(tree_node_t** link) {
+    *link = tree_merge((*link)->left, (*link)->right);
+}
+
+/* The link to the smallest node of at least size bytes, the lowest of
+ * those if there are several, or NULL, in the tree whose root is at
+ * link. */
+static tree_node_t** tree_best_fit(tree_node_t** link, size_t size) {
+    tree_node_t** best = NULL;
+    while (*link) {
+        if (node_size(*link) >= size) {
+            best = link;
+            link = &(*link)->left;
+        } else {
+            link = &(*link)->right;
         }
-        tmp_alloc->size = size;
-        tmp_alloc->free = 0;
-        tmp_alloc->pre = NULL;
-        tmp_alloc->next = NULL;
-        first = tmp_alloc;
-        last = tmp_alloc;
-        memset(tmp_alloc->pointer, 0, size);
-        return tmp_alloc->pointer;
+    }
+    return best;
+}
+
+static void free_list_insert(block_t* block) {
+    free_blocks++;
+    free_bytes += block_size(block);
+    if (block_size(block) >= TREE_MIN_SIZE) {
+        int bin = tree_bin(block_size(block));
+        tree_insert(&free_trees[bin], (tree_node_t*) block);
+        nonempty_trees |= (uint64_t) 1 << bin;
+        return;
+    }
+    int class = size_class(block_size(block));
+    block->free_pre = NULL;
+    block->free_next = free_lists[class];
+    if (block->free_next) {
+        block->free_next->free_pre = block;
+    }
+    free_lists[class] = block;
+    nonempty_classes |= 1U << class;
+}
+
+static void free_list_remove(block_t* block) {
+    free_blocks--;
+    free_bytes -= block_size(block);
+    if (block_size(block) >= TREE_MIN_SIZE) {
+        int bin = tree_bin(block_size(block));
+        tree_unlink(tree_find(&free_trees[bin], (tree_node_t*) block));
+        if (!free_trees[bin]) {
+            nonempty_trees &= ~((uint64_t) 1 << bin);
+        }
+        return;
+    }
+    int class = size_class(block_size(block));
+    if (block->free_pre) {
+        block->free_pre->free_next = block->free_next;
     } else {
-        block_t* tmp = first;
-        while(tmp) {
-            if (tmp->free && tmp->size >= size) {
-                if (tmp->size - size > BLOCKSIZE) {
-                    tmp->free = 0;
-                    tmp->size = size;
-                    // void pointer calculate by bytes for pointer addition and subtraction.
-                    block_t* nextblock = memset(tmp->pointer, 0, size) + size;
-                    nextblock->size = tmp->size - size - BLOCKSIZE;
-                    nextblock->free = 1;
-                    nextblock->pre = tmp;
-                    nextblock->next = tmp->next;
-                    if (nextblock->next) {
-                        nextblock->next->pre = nextblock;
-                    }
-                    tmp->next = nextblock;
-                    return tmp->pointer;
-                } else {
-                    tmp->free = 0;
-//                    tmp->size = size;
-                    memset(tmp->pointer, 0, size);
-                    return tmp->pointer;
-                }
+        free_lists[class] = block->free_next;
+        if (!free_lists[class]) {
+            nonempty_classes &= ~(1U << class);
+        }
+    }
+    if (block->free_next) {
+        block->free_next->free_pre = block->free_pre;
+    }
+}
+
+/*
+ * Returns a free block of at least size bytes, taken off its free list, or
+ * NULL. Small requests are served first fit: the request's own class may
+ * hold blocks that are too small, so only a few of them are tried, and any
+ * block of a larger class fits, so the first non-empty one found in the
+ * bitmap is used. Large requests, and small ones when no list can serve
+ * them, take the best fit from the trees; the lowest of equal fits, which
+ * keeps the top of the heap free for trimming.
+ */
+static block_t* find_free_block(size_t size) {
+    if (size < TREE_MIN_SIZE) {
+        int class = size_class(size);
+        block_t* tmp = free_lists[class];
+        for (int i = 0; tmp && i < CLASS_SCAN_LIMIT; i++, tmp = tmp->free_next) {
+            if (block_size(tmp) >= size) {
+                free_list_remove(tmp);
+                return tmp;
+            }
+        }
+        unsigned int larger = nonempty_classes & ~((2U << class) - 1);
+        if (larger) {
+            tmp = free_lists[__builtin_ctz(larger)];
+            free_list_remove(tmp);
+            return tmp;
+        }
+    }
+    int bin = size < TREE_MIN_SIZE ? 0 : tree_bin(size);
+    tree_node_t** link = tree_best_fit(&free_trees[bin], size);
+    if (!link) {
+        /* Any block of a later bin fits, so the first of the first
+         * non-empty one is the best. */
+        uint64_t later = nonempty_trees & ~(((uint64_t) 2 << bin) - 1);
+        if (!later) {
+            return NULL;
+        }
+        bin = __builtin_ctzll(later);
+        link = &free_trees[bin];
+        while ((*link)->left) {
+            link = &(*link)->left;
+        }
+    }
+    block_t* block = (block_t*) *link;
+    free_blocks--;
+    free_bytes -= block_size(block);
+    tree_unlink(link);
+    if (!free_trees[bin]) {
+        nonempty_trees &= ~((uint64_t) 1 << bin);
+    }
+    return block;
+}
+
+/* Marks a free block, already off its free list, as in use. */
+static void take_block(block_t* block) {
+    block->header &= ~(size_t) BLOCK_FREE;
+    next_block(block)->header &= ~(size_t) PREV_FREE;
+}
+
+/* Ends the heap with an epilogue at the given address. */
+static void set_epilogue(block_t* epilogue) {
+    epilogue->header = 0;
+    heap_end = (char*) epilogue + HEADER_SIZE;
+}
+
+/* Counts bytes added to the heap by moving the break. */
+static void heap_grew(size_t bytes) {
+    heap_bytes += bytes;
+    if (heap_bytes > heap_peak) {
+        heap_peak = heap_bytes;
+    }
+}
+
+/* Whether block is the last one before the epilogue and the break, so
+ * that it can grow or shrink with the break. */
+static int at_break(block_t* block) {
+    return (char*) next_block(block) + HEADER_SIZE == heap_end &&
+           sbrk(0) == (void*) heap_end;
+}
+
+static void heap_free(block_t* block);
+
+/* Gives the tail of block beyond size bytes back to the heap, if it is big
+ * enough to hold a block. Caller holds heap_lock. */
+static void split(block_t* block, size_t size) {
+    size_t rest = block_size(block) - size;
+    if (rest < MIN_BLOCK) {
+        return;
+    }
+    block_t* tail = (block_t*) ((char*) block + size);
+    tail->header = rest;
+    block->header = size | (block->header & FLAGS);
+    heap_free(tail);
+}
+
+/* Takes a block of at least size bytes from the shared heap. Caller holds
+ * heap_lock. */
+static block_t* heap_malloc(size_t size) {
+    block_t* block = find_free_block(size);
+    if (block) {
+        take_block(block);
+        split(block, size);
+        return block;
+    }
+
+    char* brk = sbrk(0);
+    if (brk == heap_end) {
+        /* The old epilogue, or a free block right before it, becomes the
+         * start of the new block. */
+        block = (block_t*) (heap_end - HEADER_SIZE);
+        size_t grow = size;
+        if (block->header & PREV_FREE) {
+            block = prev_block(block);
+            free_list_remove(block);
+            if (block_size(block) >= size) {
+                take_block(block);
+                split(block, size);
+                return block;
+            }
+            grow -= block_size(block);
+        }
+        if (sbrk(grow) == (void*) -1) {
+            perror("Error allocate new block with sbrk.");
+            if (block->header & BLOCK_FREE) {
+                free_list_insert(block);
             }
-            tmp = tmp->next;
+            return NULL;
         }
-        block_t* tmp_alloc = sbrk(BLOCKSIZE + size);
-        if (tmp_alloc == (void*) -1) {
+        heap_grew(grow);
+    } else {
+        /* Someone else (libc's malloc, say) has moved the break, and blocks
+         * that are not adjacent must never be merged: start a new stretch,
+         * padded so that payloads are aligned. */
+        size_t pad = -(uintptr_t) (brk + HEADER_SIZE) & (ALIGNMENT - 1);
+        if (sbrk(pad + size + HEADER_SIZE) == (void*) -1) {
             perror("Error allocate new block with sbrk.");
             return NULL;
         }
-        tmp_alloc->size = size;
-        tmp_alloc->free = 0;
-        tmp_alloc->pre = last;
-        tmp_alloc->next = NULL;
-        last->next = tmp_alloc;
-        last = tmp_alloc;
-        memset(tmp_alloc->pointer, 0, size);
-        return tmp_alloc->pointer;
+        heap_grew(pad + size + HEADER_SIZE);
+        block = (block_t*) (brk + pad);
+    }
+    block->header = size;
+    set_epilogue(next_block(block));
+    return block;
+}
+
+void mm_set_mmap_threshold(size_t threshold) {
+    /* Small blocks always go through the thread caches. */
+    mmap_threshold = threshold > CACHE_MAX_SIZE ? threshold : CACHE_MAX_SIZE;
+}
+
+/* A mapped block keeps, in the word before its header, how far into its
+ * mapping the header is. */
+static size_t* mapping_offset(block_t* block) {
+    return (size_t*) block - 1;
+}
+
+static size_t mapping_length(block_t* block) {
+    return page_align(*mapping_offset(block) + block_size(block));
+}
+
+/* Maps a block of its own for size bytes, with its payload aligned to
+ * alignment; the rest of the last page is part of it. */
+static block_t* mmap_malloc(size_t size, size_t alignment) {
+    size_t length = page_align(size + alignment);
+    char* mapping = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        perror("Error allocate new block with mmap.");
+        return NULL;
+    }
+    uintptr_t aligned = ((uintptr_t) mapping + 2 * HEADER_SIZE + alignment - 1) &
+                        ~(alignment - 1);
+    block_t* block = block_of((void*) aligned);
+    size_t offset = (char*) block - mapping;
+    *mapping_offset(block) = offset;
+    block->header = ((length - offset) & ~(size_t) FLAGS) | BLOCK_MMAPPED;
+    __atomic_add_fetch(&mapped_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mapped_bytes, length, __ATOMIC_RELAXED);
+    return block;
+}
+
+static void mmap_free(block_t* block) {
+    size_t length = mapping_length(block);
+    munmap((char*) block - *mapping_offset(block), length);
+    __atomic_sub_fetch(&mapped_blocks, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&mapped_bytes, length, __ATOMIC_RELAXED);
+}
+
+/* Resizes a mapped block, letting the kernel move its pages rather than
+ * copying them. */
+static block_t* mmap_realloc(block_t* block, size_t size) {
+    size_t offset = *mapping_offset(block);
+    size_t old_length = mapping_length(block);
+    size_t length = page_align(offset + size);
+    if (length == old_length) {
+        return block;
+    }
+    char* mapping = mremap((char*) block - offset, old_length, length, MREMAP_MAYMOVE);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    block = (block_t*) (mapping + offset);
+    block->header = ((length - offset) & ~(size_t) FLAGS) | BLOCK_MMAPPED;
+    __atomic_add_fetch(&mapped_bytes, length - old_length, __ATOMIC_RELAXED);
+    return block;
+}
+
+static void reserve_slab_region(void) {
+    /* Pages are only backed by memory once touched. */
+    char* region = mmap(NULL, SLAB_REGION, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        perror("Error reserve slab region with mmap.");
+        return;
+    }
+    slab_top = region;
+    slab_base = region;
+}
+
+static int is_slab_object(void* ptr) {
+    return slab_base && (uintptr_t) ((char*) ptr - slab_base) < SLAB_REGION;
+}
+
+static slab_t* slab_of(void* ptr) {
+    return (slab_t*) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+/* Size of the slab objects that hold size bytes. */
+static size_t object_size(size_t size) {
+    return size <= ALIGNMENT ? ALIGNMENT : (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+}
+
+static void slab_list_insert(slab_t** list, slab_t* slab) {
+    slab->pre = NULL;
+    slab->next = *list;
+    if (slab->next) {
+        slab->next->pre = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->pre) {
+        slab->pre->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->pre = slab->pre;
+    }
+}
+
+/* Sets up a slab of objects of size bytes, reusing an empty or released
+ * slab of any size before taking a new page from the region. Caller holds
+ * slab_lock. */
+static slab_t* new_slab(size_t size) {
+    slab_t* slab = empty_slabs;
+    if (slab) {
+        slab_list_remove(&empty_slabs, slab);
+    } else if (released_slabs) {
+        slab_index_t* index = released_slabs;
+        if (index->count) {
+            slab = index->slabs[--index->count];
+        } else {
+            released_slabs = index->next;
+            slab = (slab_t*) index;
+        }
+    } else {
+        if (!slab_base || slab_top == slab_base + SLAB_REGION) {
+            return NULL;
+        }
+        slab = (slab_t*) slab_top;
+        slab_top += SLAB_SIZE;
+    }
+    slab->free = NULL;
+    slab->unused = (char*) slab + SLAB_HEADER;
+    slab->size = size;
+    slab->used = 0;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER) / size;
+    return slab;
+}
+
+/* Returns an object of size bytes. Caller holds slab_lock. */
+static void* slab_malloc(size_t size) {
+    slab_t** partial = &partial_slabs[size / ALIGNMENT - 1];
+    slab_t* slab = *partial;
+    if (!slab) {
+        slab = new_slab(size);
+        if (!slab) {
+            return NULL;
+        }
+        slab_list_insert(partial, slab);
+    }
+    void* object = slab->free;
+    if (object) {
+        slab->free = *(void**) object;
+    } else {
+        object = slab->unused;
+        slab->unused += size;
+    }
+    if (++slab->used == slab->capacity) {
+        slab_list_remove(partial, slab);
+    }
+    slab_used_bytes += size;
+    return object;
+}
+
+/* Caller holds slab_lock. */
+static void slab_free(void* object) {
+    slab_t* slab = slab_of(object);
+    slab_t** partial = &partial_slabs[slab->size / ALIGNMENT - 1];
+    if (slab->used == slab->capacity) {
+        slab_list_insert(partial, slab);
+    }
+    *(void**) object = slab->free;
+    slab->free = object;
+    slab_used_bytes -= slab->size;
+    if (!--slab->used) {
+        slab_list_remove(partial, slab);
+        slab_list_insert(&empty_slabs, slab);
+    }
+}
+
+void mm_release_empty_slabs(void) {
+    pthread_mutex_lock(&slab_lock);
+    while (empty_slabs) {
+        slab_t* slab = empty_slabs;
+        slab_list_remove(&empty_slabs, slab);
+        slab_index_t* index = released_slabs;
+        if (!index || index->count == sizeof(index->slabs) / sizeof(index->slabs[0])) {
+            index = (slab_index_t*) slab;
+            index->next = released_slabs;
+            index->count = 0;
+            released_slabs = index;
+            continue;
+        }
+        madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+        index->slabs[index->count++] = slab;
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/* Hands a batch of cached objects back to the slabs or the heap. */
+static void flush_bin(thread_cache_t* thread_cache, int bin, int count) {
+    int slab = bin < SLAB_CLASSES;
+    pthread_mutex_lock(slab ? &slab_lock : &heap_lock);
+    for (int i = 0; i < count && thread_cache->bins[bin]; i++) {
+        void* object = thread_cache->bins[bin];
+        thread_cache->bins[bin] = *(void**) object;
+        if (slab) {
+            slab_free(object);
+        } else {
+            heap_free(block_of(object));
+        }
+        thread_cache->counts[bin]--;
+    }
+    pthread_mutex_unlock(slab ? &slab_lock : &heap_lock);
+}
+
+/* Gives every cached object back when a thread exits, and keeps its
+ * request counts. A free after this (from another destructor, say)
+ * registers the cache again, and this runs once more. */
+static void flush_cache(void* arg) {
+    thread_cache_t* thread_cache = arg;
+    for (int i = 0; i < CACHE_BINS; i++) {
+        flush_bin(thread_cache, i, thread_cache->counts[i]);
+    }
+    pthread_mutex_lock(&caches_lock);
+    thread_cache_t** link = &caches;
+    while (*link != thread_cache) {
+        link = &(*link)->next;
+    }
+    *link = thread_cache->next;
+    for (int i = 0; i < MM_STATS_BUCKETS; i++) {
+        exited_requests[i] += thread_cache->requests[i];
+        thread_cache->requests[i] = 0;
+    }
+    pthread_mutex_unlock(&caches_lock);
+    cache_registered = 0;
+}
+
+static void make_cache_key(void) {
+    pthread_key_create(&cache_key, flush_cache);
+}
+
+static void register_cache(void) {
+    pthread_once(&cache_key_once, make_cache_key);
+    pthread_setspecific(cache_key, &cache);
+    pthread_mutex_lock(&caches_lock);
+    cache.next = caches;
+    caches = &cache;
+    pthread_mutex_unlock(&caches_lock);
+    cache_registered = 1;
+}
+
+/*
+ * The heap profiler. While a sampling rate is set, every thread counts down
+ * the bytes it asks for, and the request that takes the count to zero is
+ * sampled: it gets a heap block marked BLOCK_SAMPLED, with room at the end
+ * for the stack that asked for it and the size asked for, and the counts
+ * of that stack go up. Freeing the block takes it off again. Intervals are
+ * drawn from an exponential distribution with the rate as mean, so that
+ * every byte is as likely to be sampled as any other and the counts can
+ * be scaled back up to estimates, which pprof does.
+ */
+#define PROFILE_DEPTH 32
+#define PROFILE_BUCKETS 4096
+#define PROFILE_TRAILER (2 * sizeof(size_t))
+/* Frames of the profiler itself at the top of every backtrace. */
+#define PROFILE_SKIP 2
+#define PROFILE_POOL (64 * 1024)
+
+typedef struct profile_stack {
+    struct profile_stack* next;
+    uint64_t hash;
+    int depth;
+    void* frames[PROFILE_DEPTH];
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+} profile_stack_t;
+
+/* Stacks seen so far, by hash, and mapped memory for new ones, so that
+ * profiling leaves the heap alone. Guarded by profile_lock. */
+static profile_stack_t* profile_stacks[PROFILE_BUCKETS];
+static char* profile_pool;
+static size_t profile_pool_left;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t profile_rate;
+/* Set while the profiler itself runs, so that whatever backtrace
+ * allocates is not sampled in turn. */
+static __thread int in_profiler TLS_MODEL;
+
+/* Bytes until the next sample, drawn from an exponential distribution. */
+static size_t sample_interval(size_t rate) {
+    uint64_t x = cache.sample_seed;
+    if (!x) {
+        x = (uintptr_t) &cache * 0x9e3779b97f4a7c15 | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    cache.sample_seed = x;
+    double interval = -log(((x >> 11) + 1) * 0x1p-53) * rate;
+    return interval < 1 ? 1 : (size_t) interval;
+}
+
+/* Whether to sample a request of size bytes, which the countdown has run
+ * out on. A countdown of zero is not running yet. */
+static __attribute__((noinline)) int sample_due(size_t size) {
+    size_t rate = __atomic_load_n(&profile_rate, __ATOMIC_RELAXED);
+    if (!rate) {
+        __atomic_store_n(&cache.sample_left, SIZE_MAX, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (in_profiler) {
+        return 0;
+    }
+    size_t left = __atomic_load_n(&cache.sample_left, __ATOMIC_RELAXED);
+    if (!left) {
+        left = sample_interval(rate);
+    }
+    int sample = size >= left;
+    left = sample ? sample_interval(rate) : left - size;
+    __atomic_store_n(&cache.sample_left, left, __ATOMIC_RELAXED);
+    return sample;
+}
+
+/* The record of a sampled block: its stack and the size asked for. */
+static size_t* profile_trailer(block_t* block) {
+    return (size_t*) next_block(block) - 2;
+}
+
+static profile_stack_t* find_profile_stack(void** frames, int depth) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t) frames[i]) * 0x100000001b3;
+    }
+    profile_stack_t** bucket = &profile_stacks[hash % PROFILE_BUCKETS];
+    for (profile_stack_t* stack = *bucket; stack; stack = stack->next) {
+        if (stack->hash == hash && stack->depth == depth &&
+            !memcmp(stack->frames, frames, depth * sizeof(void*))) {
+            return stack;
+        }
+    }
+    if (profile_pool_left < sizeof(profile_stack_t)) {
+        void* pool = mmap(NULL, PROFILE_POOL, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) {
+            return NULL;
+        }
+        profile_pool = pool;
+        profile_pool_left = PROFILE_POOL;
+    }
+    profile_stack_t* stack = (profile_stack_t*) profile_pool;
+    profile_pool += sizeof(profile_stack_t);
+    profile_pool_left -= sizeof(profile_stack_t);
+    memset(stack, 0, sizeof(*stack));
+    stack->hash = hash;
+    stack->depth = depth;
+    memcpy(stack->frames, frames, depth * sizeof(void*));
+    stack->next = *bucket;
+    *bucket = stack;
+    return stack;
+}
+
+static __attribute__((noinline)) void profile_record(block_t* block, size_t size) {
+    void* frames[PROFILE_SKIP + PROFILE_DEPTH];
+    in_profiler = 1;
+    int depth = backtrace(frames, PROFILE_SKIP + PROFILE_DEPTH) - PROFILE_SKIP;
+    in_profiler = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_stack_t* stack = find_profile_stack(frames + PROFILE_SKIP, depth > 0 ? depth : 0);
+    if (stack) {
+        stack->live_count++;
+        stack->live_bytes += size;
+        stack->total_count++;
+        stack->total_bytes += size;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    profile_trailer(block)[0] = (uintptr_t) stack;
+    profile_trailer(block)[1] = size;
+}
+
+/* Takes a sampled block, about to be freed or resized, off the counts of
+ * its stack. */
+static void profile_free(block_t* block) {
+    profile_stack_t* stack = (profile_stack_t*) profile_trailer(block)[0];
+    size_t size = profile_trailer(block)[1];
+    block->header &= ~(size_t) BLOCK_SAMPLED;
+    if (stack) {
+        pthread_mutex_lock(&profile_lock);
+        stack->live_count--;
+        stack->live_bytes -= size;
+        pthread_mutex_unlock(&profile_lock);
+    }
+}
+
+/* mm_malloc, for a request the profiler samples. */
+static __attribute__((noinline)) void* sample_allocate(size_t size) {
+    size_t needed = size && size <= SIZE_MAX / 2 ? request_size(size + PROFILE_TRAILER) : 0;
+    if (!needed) {
+        return NULL;
+    }
+    block_t* block;
+    if (needed > mmap_threshold) {
+        block = mmap_malloc(needed, ALIGNMENT);
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        block = heap_malloc(needed);
+        pthread_mutex_unlock(&heap_lock);
+    }
+    if (!block) {
+        return NULL;
+    }
+    block->header |= BLOCK_SAMPLED;
+    profile_record(block, size);
+    return payload(block);
+}
+
+/* Counts a request of size bytes, new_bytes of them not held before, and
+ * tells whether to sample it. */
+static int count_request(size_t size, size_t new_bytes) {
+    if (!cache_registered) {
+        register_cache();
+    }
+    int bucket = size_class(size);
+    cache.requests[bucket < MM_STATS_BUCKETS ? bucket : MM_STATS_BUCKETS - 1]++;
+    size_t left = __atomic_load_n(&cache.sample_left, __ATOMIC_RELAXED);
+    if (__builtin_expect(new_bytes >= left, 0)) {
+        return sample_due(new_bytes);
+    }
+    __atomic_store_n(&cache.sample_left, left - new_bytes, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void cache_push(int bin, void* object) {
+    *(void**) object = cache.bins[bin];
+    cache.bins[bin] = object;
+    cache.counts[bin]++;
+}
+
+/* Fills an empty bin of slab objects of size bytes. */
+static void refill_from_slabs(int bin, size_t size) {
+    pthread_once(&slab_once, reserve_slab_region);
+    pthread_mutex_lock(&slab_lock);
+    for (int i = 0; i < CACHE_BATCH; i++) {
+        void* object = slab_malloc(size);
+        if (!object) {
+            break;
+        }
+        cache_push(bin, object);
     }
+    pthread_mutex_unlock(&slab_lock);
+}
 
+/* Fills an empty bin of heap blocks of size bytes. Returns a block that
+ * came out bigger, as splitting may leave a block too small to split
+ * further, or NULL. */
+static block_t* refill_from_heap(int bin, size_t size) {
+    pthread_mutex_lock(&heap_lock);
+    for (int i = 0; i < CACHE_BATCH; i++) {
+        block_t* block = heap_malloc(size);
+        if (!block) {
+            break;
+        }
+        if (block_size(block) != size) {
+            pthread_mutex_unlock(&heap_lock);
+            return block;
+        }
+        cache_push(bin, payload(block));
+    }
+    pthread_mutex_unlock(&heap_lock);
     return NULL;
 }
 
+/* Pops a cached object of exactly size bytes (for heap blocks, block
+ * size), refilling the bin with a batch when it is empty. */
+static void* cache_malloc(size_t size) {
+    int bin = size / ALIGNMENT - 1;
+    if (!cache.bins[bin]) {
+        if (!cache_registered) {
+            register_cache();
+        }
+        if (bin < SLAB_CLASSES) {
+            refill_from_slabs(bin, size);
+        } else {
+            block_t* block = refill_from_heap(bin, size);
+            if (block) {
+                return payload(block);
+            }
+        }
+        if (!cache.bins[bin]) {
+            return NULL;
+        }
+    }
+    void* object = cache.bins[bin];
+    cache.bins[bin] = *(void**) object;
+    cache.counts[bin]--;
+    return object;
+}
+
+/* Caches an object of size bytes, flushing a batch of its bin when the
+ * bin is full. */
+static void cache_free(void* object, size_t size) {
+    int bin = size / ALIGNMENT - 1;
+    if (cache.counts[bin] >= CACHE_LIMIT) {
+        flush_bin(&cache, bin, CACHE_BATCH);
+    }
+    if (!cache_registered) {
+        register_cache();
+    }
+    cache_push(bin, object);
+}
+
+/* mm_malloc, without counting the request. */
+static void* allocate(size_t size) {
+    if (!size) {
+        return NULL;
+    }
+    if (size <= SLAB_MAX_SIZE) {
+        void* object = cache_malloc(object_size(size));
+        if (object) {
+            return object;
+        }
+        /* The slab region is used up; fall back to the heap. */
+    }
+    size = request_size(size);
+    if (!size) {
+        return NULL;
+    }
+
+    if (size <= CACHE_MAX_SIZE && size > SLAB_MAX_SIZE) {
+        return cache_malloc(size);
+    }
+    block_t* block;
+    if (size > mmap_threshold) {
+        block = mmap_malloc(size, ALIGNMENT);
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        block = heap_malloc(size);
+        pthread_mutex_unlock(&heap_lock);
+    }
+    return block ? payload(block) : NULL;
+}
+
+void *mm_malloc(size_t size) {
+    return count_request(size, size) ? sample_allocate(size) : allocate(size);
+}
+
+/*
+ * Like mm_malloc, but zeroed. Only memory that may have been used before
+ * is cleared: fresh mappings are zero, and so is anything sbrk hands out
+ * past the page the break was in, since the kernel unmaps whole pages
+ * when the break moves down.
+ */
+void *mm_calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    size *= nmemb;
+    if (count_request(size, size)) {
+        void* ptr = sample_allocate(size);
+        if (ptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+    if (!size) {
+        return NULL;
+    }
+    if (size <= CACHE_MAX_SIZE) {
+        /* Small enough that clearing it all costs next to nothing. */
+        void* ptr = allocate(size);
+        if (ptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+    size = request_size(size);
+    if (!size) {
+        return NULL;
+    }
+
+    block_t* block;
+    char* clean;
+    if (size > mmap_threshold) {
+        block = mmap_malloc(size, ALIGNMENT);
+        clean = (char*) block;
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        clean = (char*) page_align((uintptr_t) sbrk(0));
+        block = heap_malloc(size);
+        pthread_mutex_unlock(&heap_lock);
+    }
+    if (!block) {
+        return NULL;
+    }
+    char* start = payload(block);
+    char* end = (char*) block + size;
+    if (clean > start) {
+        memset(start, 0, (clean < end ? clean : end) - start);
+    }
+    return start;
+}
+
+/*
+ * Like mm_malloc, but the payload is aligned to alignment, a power of two.
+ * On the heap this takes a block with room to spare, finds the aligned
+ * payload in it and gives back what is left on either side, so the
+ * leading gap is either empty or big enough to be a block.
+ */
+void *mm_memalign(size_t alignment, size_t size) {
+    if (!alignment || alignment & (alignment - 1) || alignment > SIZE_MAX / 4) {
+        return NULL;
+    }
+    /* Sampled blocks are only ever aligned like any other. */
+    if (count_request(size, size) && alignment <= ALIGNMENT) {
+        return sample_allocate(size);
+    }
+    if (alignment <= ALIGNMENT) {
+        return allocate(size);
+    }
+    if (!size) {
+        return NULL;
+    }
+    size = request_size(size);
+    if (!size) {
+        return NULL;
+    }
+    if (size + alignment > mmap_threshold) {
+        block_t* block = mmap_malloc(size, alignment);
+        return block ? payload(block) : NULL;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    block_t* block = heap_malloc(size + alignment + MIN_BLOCK);
+    if (block) {
+        uintptr_t start = (uintptr_t) payload(block);
+        uintptr_t aligned = (start + alignment - 1) & ~(alignment - 1);
+        if (aligned != start && aligned - start < MIN_BLOCK) {
+            aligned += alignment;
+        }
+        if (aligned != start) {
+            block_t* lead = block;
+            block = block_of((void*) aligned);
+            block->header = block_size(lead) - (aligned - start);
+            lead->header = (aligned - start) | (lead->header & PREV_FREE);
+            heap_free(lead);
+        }
+        split(block, size);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return block ? payload(block) : NULL;
+}
+
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (!alignment || alignment % sizeof(void*) || alignment & (alignment - 1)) {
+        return EINVAL;
+    }
+    void* ptr = mm_memalign(alignment, size);
+    if (!ptr && size) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+/*
+ * Resizes a heap block to size bytes without moving it: by splitting off
+ * the tail, by absorbing a free block right after it, or by moving the
+ * break when it is the last block. Returns 0 if none of that is possible.
+ * Caller holds heap_lock.
+ */
+static int heap_resize(block_t* block, size_t size) {
+    size_t old_size = block_size(block);
+    if (size <= old_size) {
+        split(block, size);
+        return 1;
+    }
+    block_t* next = next_block(block);
+    int next_free = next->header & BLOCK_FREE;
+    size_t available = old_size + (next_free ? block_size(next) : 0);
+    if (available < size && !at_break(next_free ? next : block)) {
+        return 0;
+    }
+    if (next_free) {
+        free_list_remove(next);
+        block->header += block_size(next);
+        next_block(block)->header &= ~(size_t) PREV_FREE;
+    }
+    if (available < size) {
+        /* Padded so that a block growing a little at a time does not cost
+         * a system call each time; the excess is split off again below. */
+        size_t grow = size - available < TOP_PAD ? TOP_PAD : size - available;
+        if (sbrk(grow) == (void*) -1) {
+            split(block, old_size);
+            return 0;
+        }
+        heap_grew(grow);
+        block->header += grow;
+        set_epilogue(next_block(block));
+    }
+    split(block, size);
+    return 1;
+}
+
 void *mm_realloc(void *ptr, size_t size) {
+    /* Only what a block grows by is new to the profiler. */
+    size_t old_size = mm_usable_size(ptr);
+    int sample = count_request(size, size > old_size ? size - old_size : 0);
     if (ptr) {
         if (!size) {
             mm_free(ptr);
             return NULL;
-        } else {
-            void* malloc = mm_malloc(size);
-            if (!malloc) {
+        }
+        if (sample) {
+            void* moved = sample_allocate(size);
+            if (!moved) {
                 return NULL;
             }
-            block_t* meta_malloc = (block_t*) (malloc - BLOCKSIZE);
-            block_t* meta_ptr = (block_t*) (ptr - BLOCKSIZE);
-            if (meta_malloc->size >= meta_ptr->size) {
-                memcpy(meta_malloc->pointer, ptr, meta_ptr->size);
-            } else {
-                memcpy(meta_malloc->pointer, ptr, meta_malloc->size);
+            memcpy(moved, ptr, old_size < size ? old_size : size);
+            mm_free(ptr);
+            return moved;
+        }
+        /* Resized like any other block, a sampled one is a sample no
+         * more. */
+        if (!is_slab_object(ptr) && block_of(ptr)->header & BLOCK_SAMPLED) {
+            profile_free(block_of(ptr));
+        }
+        if (is_slab_object(ptr)) {
+            if (size <= old_size && size > old_size / 2) {
+                return ptr;
+            }
+            void* malloc = allocate(size);
+            if (!malloc) {
+                return NULL;
             }
+            memcpy(malloc, ptr, old_size < size ? old_size : size);
             mm_free(ptr);
-            return meta_malloc->pointer;
+            return malloc;
         }
-    } else {
-        if (!size) {
+        block_t* meta_ptr = block_of(ptr);
+        size_t needed = request_size(size);
+        if (!needed) {
             return NULL;
         }
-        return mm_malloc(size);
+        if (meta_ptr->header & BLOCK_MMAPPED) {
+            if (needed > mmap_threshold) {
+                block_t* moved = mmap_realloc(meta_ptr, needed);
+                if (moved) {
+                    return payload(moved);
+                }
+            }
+        } else if (needed <= mmap_threshold) {
+            pthread_mutex_lock(&heap_lock);
+            int resized = heap_resize(meta_ptr, needed);
+            pthread_mutex_unlock(&heap_lock);
+            if (resized) {
+                return ptr;
+            }
+        }
+        void* malloc = allocate(size);
+        if (!malloc) {
+            return NULL;
+        }
+        memcpy(malloc, ptr, old_size < size ? old_size : size);
+        mm_free(ptr);
+        return malloc;
+    } else {
+        return sample ? sample_allocate(size) : allocate(size);
     }
     return NULL;
 }
 
-block_t* merge(block_t* merge_pre, block_t* merge_next) {
-    merge_pre->next = merge_next->next;
-    if (merge_pre->next) {
-        merge_pre->next->pre = merge_pre;
+/* Moves the break back over block, the free block at the top of the
+ * heap. */
+static void trim(block_t* block) {
+    size_t size = block_size(block);
+    set_epilogue(block);
+    sbrk(-(intptr_t) size);
+    heap_bytes -= size;
+}
+
+/* Returns a block to the shared heap, merging it with free neighbours.
+ * Caller holds heap_lock. */
+static void heap_free(block_t* block) {
+    size_t size = block_size(block);
+    block_t* next = next_block(block);
+    if (block->header & PREV_FREE) {
+        block = prev_block(block);
+        free_list_remove(block);
+        size += block_size(block);
     }
-    merge_pre->size = merge_pre->size + merge_next->size;
-    if (last == merge_next) {
-        last = merge_pre;
+    if (next->header & BLOCK_FREE) {
+        free_list_remove(next);
+        size += block_size(next);
+    }
+    block->header = size | BLOCK_FREE;
+    set_footer(block);
+    next_block(block)->header |= PREV_FREE;
+    if (size >= TRIM_THRESHOLD && at_break(block)) {
+        trim(block);
+        return;
     }
-    return merge_pre;
+    free_list_insert(block);
+}
+
+size_t mm_usable_size(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    if (is_slab_object(ptr)) {
+        return slab_of(ptr)->size;
+    }
+    block_t* block = block_of(ptr);
+    size_t usable = block_size(block) - HEADER_SIZE;
+    return block->header & BLOCK_SAMPLED ? usable - PROFILE_TRAILER : usable;
 }
 
 void mm_free(void *ptr) {
     if (!ptr) {
         return;
     }
-    block_t* freeblock = ptr - BLOCKSIZE;
-    freeblock->free = 1;
-    if (freeblock->pre != NULL && freeblock->pre->free) {
-        freeblock = merge(freeblock->pre, freeblock);
+    if (is_slab_object(ptr)) {
+        cache_free(ptr, slab_of(ptr)->size);
+        return;
+    }
+    block_t* block = block_of(ptr);
+    if (block->header & BLOCK_SAMPLED) {
+        profile_free(block);
+    }
+    if (block->header & BLOCK_MMAPPED) {
+        mmap_free(block);
+        return;
+    }
+    /* Smaller heap blocks only come from memalign and shrinking realloc,
+     * and have no bin of their own: those bins hold slab objects. */
+    if (block_size(block) <= CACHE_MAX_SIZE && block_size(block) > SLAB_MAX_SIZE) {
+        cache_free(ptr, block_size(block));
+        return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    heap_free(block);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * An arena hands out memory by moving a pointer through chunks taken from
+ * the heap, and takes all of it back at once. Chunks stay with the arena
+ * across resets, so a program that goes through similar phases over and
+ * over stops touching the heap at all. Only objects too big to share a
+ * chunk get blocks of their own, which go back to the heap on reset.
+ */
+#define ARENA_CHUNK (64 * 1024)
+#define ARENA_LARGE (ARENA_CHUNK / 4)
+
+/* Chunks and large objects start with a link to the next one, padded so
+ * that what follows is aligned. */
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+} arena_chunk_t;
+
+struct mm_arena {
+    /* Every chunk, in the order they are used, and the one in use. */
+    arena_chunk_t* chunks;
+    arena_chunk_t* current;
+    /* The unused part of the current chunk. */
+    char* next;
+    char* end;
+    /* Large objects handed out since the last reset. */
+    arena_chunk_t* large;
+};
+
+mm_arena_t* mm_arena_create(void) {
+    mm_arena_t* arena = allocate(sizeof(mm_arena_t));
+    if (arena) {
+        memset(arena, 0, sizeof(*arena));
+    }
+    return arena;
+}
+
+/* mm_arena_alloc, when the current chunk has no room for size bytes. */
+static void* arena_refill(mm_arena_t* arena, size_t size) {
+    if (size > ARENA_LARGE) {
+        arena_chunk_t* large = allocate(ALIGNMENT + size);
+        if (!large) {
+            return NULL;
+        }
+        large->next = arena->large;
+        arena->large = large;
+        return (char*) large + ALIGNMENT;
+    }
+    arena_chunk_t* chunk = arena->current ? arena->current->next : arena->chunks;
+    if (!chunk) {
+        chunk = allocate(ARENA_CHUNK);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = NULL;
+        if (arena->current) {
+            arena->current->next = chunk;
+        } else {
+            arena->chunks = chunk;
+        }
+    }
+    arena->current = chunk;
+    arena->next = (char*) chunk + ALIGNMENT + size;
+    arena->end = (char*) chunk + ARENA_CHUNK;
+    return (char*) chunk + ALIGNMENT;
+}
+
+void* mm_arena_alloc(mm_arena_t* arena, size_t size) {
+    if (!size || size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size = (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+    if (size <= (size_t) (arena->end - arena->next)) {
+        void* object = arena->next;
+        arena->next += size;
+        return object;
+    }
+    return arena_refill(arena, size);
+}
+
+void mm_arena_reset(mm_arena_t* arena) {
+    while (arena->large) {
+        arena_chunk_t* large = arena->large;
+        arena->large = large->next;
+        mm_free(large);
+    }
+    arena->current = arena->chunks;
+    arena->next = arena->chunks ? (char*) arena->chunks + ALIGNMENT : NULL;
+    arena->end = arena->chunks ? (char*) arena->chunks + ARENA_CHUNK : NULL;
+}
+
+void mm_arena_destroy(mm_arena_t* arena) {
+    if (!arena) {
+        return;
+    }
+    mm_arena_reset(arena);
+    while (arena->chunks) {
+        arena_chunk_t* chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        mm_free(chunk);
+    }
+    mm_free(arena);
+}
+
+void mm_stats(mm_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&heap_lock);
+    stats->heap_bytes = heap_bytes;
+    stats->heap_peak = heap_peak;
+    stats->free_blocks = free_blocks;
+    stats->free_bytes = free_bytes;
+    /* The largest block is the last of the last non-empty tree, or else
+     * somewhere in the largest non-empty class. */
+    if (nonempty_trees) {
+        tree_node_t* node = free_trees[63 - __builtin_clzll(nonempty_trees)];
+        while (node->right) {
+            node = node->right;
+        }
+        stats->largest_free = node_size(node);
+    } else if (nonempty_classes) {
+        int class = 31 - __builtin_clz(nonempty_classes);
+        for (block_t* block = free_lists[class]; block; block = block->free_next) {
+            if (block_size(block) > stats->largest_free) {
+                stats->largest_free = block_size(block);
+            }
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    stats->mapped_blocks = __atomic_load_n(&mapped_blocks, __ATOMIC_RELAXED);
+    stats->mapped_bytes = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&slab_lock);
+    stats->slab_bytes = slab_top - slab_base;
+    stats->slab_used_bytes = slab_used_bytes;
+    pthread_mutex_unlock(&slab_lock);
+
+    /* Other threads keep going meanwhile, so their part is approximate. */
+    pthread_mutex_lock(&caches_lock);
+    memcpy(stats->requests, exited_requests, sizeof(stats->requests));
+    for (thread_cache_t* thread_cache = caches; thread_cache; thread_cache = thread_cache->next) {
+        for (int i = 0; i < CACHE_BINS; i++) {
+            stats->cached_bytes += (size_t) thread_cache->counts[i] * (i + 1) * ALIGNMENT;
+        }
+        for (int i = 0; i < MM_STATS_BUCKETS; i++) {
+            stats->requests[i] += thread_cache->requests[i];
+        }
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    stats->live_bytes = stats->heap_bytes - stats->free_bytes + stats->slab_used_bytes +
+                        stats->mapped_bytes - stats->cached_bytes;
+    if (stats->free_bytes) {
+        stats->fragmentation = 1 - (double) stats->largest_free / stats->free_bytes;
+    }
+}
+
+void mm_print_stats(void) {
+    mm_stats_t stats;
+    mm_stats(&stats);
+    fprintf(stderr, "mm_alloc statistics\n");
+    fprintf(stderr, "  heap           %12zu bytes, peak %zu\n", stats.heap_bytes, stats.heap_peak);
+    fprintf(stderr, "  free           %12zu bytes in %zu blocks, largest %zu, fragmentation %.2f\n",
+            stats.free_bytes, stats.free_blocks, stats.largest_free, stats.fragmentation);
+    fprintf(stderr, "  mapped         %12zu bytes in %zu blocks\n", stats.mapped_bytes,
+            stats.mapped_blocks);
+    fprintf(stderr, "  slabs          %12zu bytes, %zu in use\n", stats.slab_bytes,
+            stats.slab_used_bytes);
+    fprintf(stderr, "  thread caches  %12zu bytes\n", stats.cached_bytes);
+    fprintf(stderr, "  live           %12zu bytes\n", stats.live_bytes);
+    fprintf(stderr, "  requests by size\n");
+    for (int i = 0; i < MM_STATS_BUCKETS; i++) {
+        if (stats.requests[i]) {
+            fprintf(stderr, "  %12zu - %-12zu %12zu\n", i ? (size_t) 1 << i : 0,
+                    ((size_t) 2 << i) - 1, stats.requests[i]);
+        }
+    }
+}
+
+void mm_profile_start(size_t sample_bytes) {
+    if (sample_bytes) {
+        /* backtrace loads the unwinder, and allocates, the first time. */
+        void* frame;
+        in_profiler = 1;
+        backtrace(&frame, 1);
+        in_profiler = 0;
+    }
+    __atomic_store_n(&profile_rate, sample_bytes, __ATOMIC_RELAXED);
+    /* Every thread draws a new countdown at its next request. */
+    pthread_mutex_lock(&caches_lock);
+    for (thread_cache_t* thread_cache = caches; thread_cache; thread_cache = thread_cache->next) {
+        __atomic_store_n(&thread_cache->sample_left, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&caches_lock);
+    __atomic_store_n(&cache.sample_left, 0, __ATOMIC_RELAXED);
+}
+
+/* Output for mm_profile_dump, gathered into writes of a page at a time. */
+typedef struct profile_writer {
+    int fd;
+    size_t used;
+    char buffer[4096];
+} profile_writer_t;
+
+static void profile_flush(profile_writer_t* writer) {
+    for (size_t done = 0; done < writer->used;) {
+        ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (written <= 0) {
+            break;
+        }
+        done += written;
+    }
+    writer->used = 0;
+}
+
+static void profile_printf(profile_writer_t* writer, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(writer->buffer + writer->used, sizeof(writer->buffer) - writer->used,
+                           format, args);
+    va_end(args);
+    if (length >= 0 && writer->used + length >= sizeof(writer->buffer)) {
+        /* No room: flush and print again. */
+        profile_flush(writer);
+        va_start(args, format);
+        length = vsnprintf(writer->buffer, sizeof(writer->buffer), format, args);
+        va_end(args);
+    }
+    if (length > 0 && (size_t) length < sizeof(writer->buffer)) {
+        writer->used += length;
+    }
+}
+
+/*
+ * The format is that of gperftools' heap profiles, which pprof reads:
+ * a line of totals, then for each stack its live objects and bytes and,
+ * in brackets, all it ever allocated, then the mappings of the process,
+ * for pprof to find symbols with. The counts are of samples; heap_v2
+ * tells pprof the rate, to scale them up with.
+ */
+int mm_profile_dump(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    profile_writer_t writer = {.fd = fd};
+
+    pthread_mutex_lock(&profile_lock);
+    size_t totals[4] = {0};
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        for (profile_stack_t* stack = profile_stacks[i]; stack; stack = stack->next) {
+            totals[0] += stack->live_count;
+            totals[1] += stack->live_bytes;
+            totals[2] += stack->total_count;
+            totals[3] += stack->total_bytes;
+        }
+    }
+    profile_printf(&writer, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n", totals[0],
+                   totals[1], totals[2], totals[3],
+                   __atomic_load_n(&profile_rate, __ATOMIC_RELAXED));
+    for (int i = 0; i < PROFILE_BUCKETS; i++) {
+        for (profile_stack_t* stack = profile_stacks[i]; stack; stack = stack->next) {
+            profile_printf(&writer, "%6zu: %8zu [%6zu: %8zu] @", stack->live_count,
+                           stack->live_bytes, stack->total_count, stack->total_bytes);
+            for (int j = 0; j < stack->depth; j++) {
+                profile_printf(&writer, " %p", stack->frames[j]);
+            }
+            profile_printf(&writer, "\n");
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    profile_printf(&writer, "\nMAPPED_LIBRARIES:\n");
+    profile_flush(&writer);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t got;
+        while ((got = read(maps, writer.buffer, sizeof(writer.buffer))) > 0) {
+            writer.used = got;
+            profile_flush(&writer);
+        }
+        close(maps);
+    }
+    return close(fd);
+}
+
+/* With MM_PROFILE set, SIGUSR2 asks for a profile. The handler only
+ * writes to a pipe; a thread of ours reads it and writes the profile,
+ * which takes locks and so cannot be done in the handler. */
+static int profile_pipe[2];
+static int profile_dumps;
+
+/* Writes mm_profile.<pid>.<n>.heap in the working directory. */
+static void profile_dump_next(void) {
+    char path[64];
+    snprintf(path, sizeof(path), "mm_profile.%d.%d.heap", (int) getpid(),
+             __atomic_fetch_add(&profile_dumps, 1, __ATOMIC_RELAXED));
+    if (mm_profile_dump(path) == 0) {
+        fprintf(stderr, "mm_alloc: heap profile written to %s\n", path);
+    }
+}
+
+static void profile_signal(int signo) {
+    int saved_errno = errno;
+    ssize_t written = write(profile_pipe[1], "", 1);
+    (void) written;
+    errno = saved_errno;
+}
+
+static void* profile_dumper(void* arg) {
+    for (;;) {
+        char byte;
+        ssize_t got = read(profile_pipe[0], &byte, 1);
+        if (got > 0) {
+            profile_dump_next();
+        } else if (got == 0 || errno != EINTR) {
+            return NULL;
+        }
+    }
+}
+
+static void start_profile_dumper(void) {
+    if (pipe2(profile_pipe, O_CLOEXEC)) {
+        return;
+    }
+    /* The thread must not take signals meant for the program. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int started = !pthread_create(&thread, &attr, profile_dumper, NULL);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (started) {
+        struct sigaction action = {.sa_handler = profile_signal, .sa_flags = SA_RESTART};
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR2, &action, NULL);
+    }
+}
+
+/* fork() may come while another thread holds a lock, which would then
+ * stay locked in the child for good; holding all of them across it keeps
+ * the child's heap consistent and its locks free. */
+static void lock_all(void) {
+    pthread_mutex_lock(&caches_lock);
+    pthread_mutex_lock(&heap_lock);
+    pthread_mutex_lock(&slab_lock);
+    pthread_mutex_lock(&profile_lock);
+}
+
+static void unlock_all(void) {
+    pthread_mutex_unlock(&profile_lock);
+    pthread_mutex_unlock(&slab_lock);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&caches_lock);
+}
+
+/* Runs when the library is loaded. Setting MM_STATS in the environment
+ * prints the statistics at exit; setting MM_PROFILE to a number of bytes
+ * starts the heap profiler at that rate, with a profile written on
+ * SIGUSR2 and at exit. */
+__attribute__((constructor)) static void init(void) {
+    pthread_atfork(lock_all, unlock_all, unlock_all);
+    if (getenv("MM_STATS")) {
+        atexit(mm_print_stats);
     }
-    if (freeblock->next != NULL && freeblock->next->free) {
-        freeblock = merge(freeblock, freeblock->next);
+    char* profile = getenv("MM_PROFILE");
+    size_t rate = profile ? strtoul(profile, NULL, 10) : 0;
+    if (rate) {
+        mm_profile_start(rate);
+        start_profile_dumper();
+        atexit(profile_dump_next);
     }
 }
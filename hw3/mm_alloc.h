@@ -8,14 +8,96 @@
 
 #include <stdlib.h>
 
+/*
+ * Every block starts with a header word holding its size in bytes (header
+ * included, always a multiple of 16) and flags in the low bits. Payloads
+ * start right after the header and are 16-byte aligned. Free blocks also
+ * keep their size in their last word, so that the next block can find
+ * them, and their free list links in the payload.
+ */
 typedef struct block {
-    int size;
-    int free;
-    struct block *next;
-    struct block *pre;
-    char pointer[0];
+    size_t header;
+    /* Free blocks only: neighbours in the free list of their size class. */
+    struct block *free_next;
+    struct block *free_pre;
 } block_t;
 
 void *mm_malloc(size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
 void *mm_realloc(void *ptr, size_t size);
 void mm_free(void *ptr);
+/* Bytes the block at ptr can hold, at least what was asked for. */
+size_t mm_usable_size(void *ptr);
+
+/* Blocks whose address is a multiple of alignment, a power of two. */
+void *mm_memalign(size_t alignment, size_t size);
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/*
+ * Arenas, for objects that all die together: mm_arena_alloc hands out
+ * 16-byte aligned memory that is never passed to mm_free, and
+ * mm_arena_reset takes back everything allocated since the arena was
+ * created or last reset. An arena keeps its memory across resets, until
+ * mm_arena_destroy, and is used by one thread at a time.
+ */
+typedef struct mm_arena mm_arena_t;
+
+mm_arena_t *mm_arena_create(void);
+void *mm_arena_alloc(mm_arena_t *arena, size_t size);
+void mm_arena_reset(mm_arena_t *arena);
+void mm_arena_destroy(mm_arena_t *arena);
+
+/* Gives the pages of slabs with no objects in use back to the OS. The
+ * slabs stay around, to be reused for objects of any size. */
+void mm_release_empty_slabs(void);
+
+#define MM_STATS_BUCKETS 32
+
+/* What the allocator holds, from counters it keeps as it goes. Byte counts
+ * include block headers. */
+typedef struct mm_stats {
+    /* Bytes between the ends of the sbrk heap, now and at most. */
+    size_t heap_bytes;
+    size_t heap_peak;
+    /* Free heap blocks, the bytes in them and the largest. */
+    size_t free_blocks;
+    size_t free_bytes;
+    size_t largest_free;
+    /* Blocks with a mapping of their own, and the bytes mapped. */
+    size_t mapped_blocks;
+    size_t mapped_bytes;
+    /* Bytes of slabs set up so far, and of objects handed out of them. */
+    size_t slab_bytes;
+    size_t slab_used_bytes;
+    /* Bytes of objects in thread caches, waiting to be reused. */
+    size_t cached_bytes;
+    /* Bytes the program holds. */
+    size_t live_bytes;
+    /* 1 - largest_free / free_bytes: 0 when all free heap memory is in a
+     * single block. */
+    double fragmentation;
+    /* Requests by size: bucket i counts requests of 2^i to 2^(i+1) - 1
+     * bytes, and bucket 0 those of 0 and 1. */
+    size_t requests[MM_STATS_BUCKETS];
+} mm_stats_t;
+
+void mm_stats(mm_stats_t *stats);
+/* Prints mm_stats to stderr. Runs at exit when MM_STATS is set in the
+ * environment. */
+void mm_print_stats(void);
+
+/*
+ * Heap profiling: samples about one request per sample_bytes bytes asked
+ * for, recording the stack of each sampled one, and keeps the objects and
+ * bytes live and ever allocated per stack. A rate of 0 stops sampling.
+ * mm_profile_dump writes what was recorded as a heap profile for pprof,
+ * returning 0 or -1 with errno set. Setting MM_PROFILE in the environment
+ * to a rate starts profiling at load, with a profile written to
+ * mm_profile.<pid>.<n>.heap on SIGUSR2 and at exit.
+ */
+void mm_profile_start(size_t sample_bytes);
+int mm_profile_dump(const char *path);
+
+/* Requests above threshold bytes get a mapping of their own (default
+ * 128 KB). */
+void mm_set_mmap_threshold(size_t threshold);
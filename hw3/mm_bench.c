@@ -0,0 +1,139 @@
+/*
+ * mm_bench.c
+ *
+ * Times mm_malloc/mm_free pairs against heaps holding more and more live
+ * blocks. With every other block freed the heap is fragmented, which is
+ * the worst case for an allocator that searches it linearly; a constant
+ * cost per operation across heap sizes is what we are after.
+ *
+ * First, though, it allocates a million small objects, like the tokens
+ * and work queue items of the other homeworks, and frees them again,
+ * reporting the time per operation and the memory each object took. Then
+ * it runs phases of objects that all die together, like the words of a
+ * command line, freeing them one by one and then resetting an arena.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm_alloc.h"
+
+#define OPERATIONS 200000
+#define MAX_SIZE 512
+#define SMALL_OBJECTS 1000000
+#define SMALL_MAX_SIZE 64
+#define PHASES 1000
+#define PHASE_OBJECTS 1000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Resident memory of the process, in bytes. */
+static long resident(void) {
+    long size, pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        fscanf(statm, "%ld %ld", &size, &pages);
+        fclose(statm);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+static void bench_small_objects(void) {
+    static void *objects[SMALL_OBJECTS];
+    /* Fault the array in first, so that only the objects are counted. */
+    memset(objects, 0, sizeof(objects));
+    long before = resident();
+    double start = now();
+    for (int i = 0; i < SMALL_OBJECTS; i++) {
+        objects[i] = mm_malloc(8 + rand() % (SMALL_MAX_SIZE - 7));
+        *(int *) objects[i] = i;
+    }
+    double allocated = now();
+    long used = resident() - before;
+    for (int i = 0; i < SMALL_OBJECTS; i++) {
+        mm_free(objects[i]);
+    }
+    double freed = now();
+    printf("%d small objects of 8 to %d bytes\n", SMALL_OBJECTS, SMALL_MAX_SIZE);
+    printf("%12s %14.1f\n", "ns per malloc", (allocated - start) * 1e9 / SMALL_OBJECTS);
+    printf("%12s %14.1f\n", "ns per free", (freed - allocated) * 1e9 / SMALL_OBJECTS);
+    printf("%12s %14.1f\n\n", "bytes each", (double) used / SMALL_OBJECTS);
+}
+
+static void bench_phases(void) {
+    static size_t sizes[PHASE_OBJECTS];
+    static void *objects[PHASE_OBJECTS];
+    for (int i = 0; i < PHASE_OBJECTS; i++) {
+        sizes[i] = 8 + rand() % 249;
+    }
+
+    double start = now();
+    for (int phase = 0; phase < PHASES; phase++) {
+        for (int i = 0; i < PHASE_OBJECTS; i++) {
+            objects[i] = mm_malloc(sizes[i]);
+            *(int *) objects[i] = i;
+        }
+        for (int i = 0; i < PHASE_OBJECTS; i++) {
+            mm_free(objects[i]);
+        }
+    }
+    double freed = now();
+    mm_arena_t *arena = mm_arena_create();
+    for (int phase = 0; phase < PHASES; phase++) {
+        for (int i = 0; i < PHASE_OBJECTS; i++) {
+            objects[i] = mm_arena_alloc(arena, sizes[i]);
+            *(int *) objects[i] = i;
+        }
+        mm_arena_reset(arena);
+    }
+    double reset = now();
+    mm_arena_destroy(arena);
+
+    printf("%d phases of %d objects of 8 to 256 bytes, ns per object\n", PHASES,
+           PHASE_OBJECTS);
+    printf("%12s %14.1f\n", "mm_free", (freed - start) * 1e9 / (PHASES * PHASE_OBJECTS));
+    printf("%12s %14.1f\n\n", "arena reset", (reset - freed) * 1e9 / (PHASES * PHASE_OBJECTS));
+}
+
+int main(int argc, char **argv) {
+    static const int heap_sizes[] = {1000, 10000, 100000};
+    int operations = argc > 1 ? atoi(argv[1]) : OPERATIONS;
+    int live_total = 0;
+    /* Not from malloc: libc must not move the break while we measure. */
+    static void *live[100000];
+
+    srand(162);
+    bench_small_objects();
+    bench_phases();
+    printf("%12s %14s\n", "live blocks", "ns per op");
+    for (int h = 0; h < sizeof(heap_sizes) / sizeof(heap_sizes[0]); h++) {
+        /* Grow the heap, keeping only every other new block. */
+        for (int i = live_total; i < heap_sizes[h]; i++) {
+            void *keep = mm_malloc(16 + rand() % MAX_SIZE);
+            void *hole = mm_malloc(16 + rand() % MAX_SIZE);
+            live[i] = keep;
+            mm_free(hole);
+        }
+        live_total = heap_sizes[h];
+
+        double start = now();
+        for (int i = 0; i < operations; i++) {
+            void *p = mm_malloc(16 + rand() % MAX_SIZE);
+            mm_free(p);
+        }
+        double elapsed = now() - start;
+        printf("%12d %14.1f\n", live_total, elapsed * 1e9 / (2.0 * operations));
+    }
+
+    for (int i = 0; i < live_total; i++) {
+        mm_free(live[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * mm_preload.c
+ *
+ * The standard allocation functions on top of mm_alloc, so that any
+ * program can run on it:
+ *
+ *   LD_PRELOAD=./hw3preload.so ls -l
+ *
+ * Unlike mm_malloc, these follow glibc where programs depend on it:
+ * malloc(0) returns a block rather than NULL (many programs take NULL
+ * for running out of memory), and failures set errno.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mm_alloc.h"
+
+void *malloc(size_t size) {
+    void *ptr = mm_malloc(size ? size : 1);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr) {
+    mm_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *ptr = mm_calloc(nmemb && size ? nmemb : 1, nmemb && size ? size : 1);
+    if (!ptr) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr && !size) {
+        mm_free(ptr);
+        return NULL;
+    }
+    void *moved = mm_realloc(ptr, size ? size : 1);
+    if (!moved) {
+        errno = ENOMEM;
+    }
+    return moved;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+    if (size && nmemb > (size_t) -1 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    return mm_posix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = mm_memalign(alignment, size ? size : 1);
+    if (!ptr) {
+        errno = alignment && !(alignment & (alignment - 1)) ? ENOMEM : EINVAL;
+    }
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
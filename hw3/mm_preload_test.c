@@ -0,0 +1,96 @@
+/*
+ * mm_preload_test.c
+ *
+ * Checks hw3preload.so from the outside: an ordinary program, using
+ * plain malloc and friends, run with
+ *
+ *   LD_PRELOAD=./hw3preload.so ./mm_preload_test
+ *
+ * Threads allocate and free all the time while the main thread forks;
+ * every child must be able to allocate and exit cleanly, which it could
+ * not if a lock were held across fork.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define THREADS 4
+#define FORKS 200
+
+static volatile int done;
+
+static void *churn(void *arg) {
+    unsigned int seed = (unsigned int) (long) arg;
+    void *blocks[64] = {NULL};
+    while (!done) {
+        int i = rand_r(&seed) % 64;
+        free(blocks[i]);
+        blocks[i] = malloc(1 + rand_r(&seed) % 4096);
+        assert(blocks[i] != NULL);
+    }
+    for (int i = 0; i < 64; i++) {
+        free(blocks[i]);
+    }
+    return NULL;
+}
+
+int main(void) {
+    if (!dlsym(RTLD_DEFAULT, "mm_malloc")) {
+        fprintf(stderr, "Run with LD_PRELOAD=./hw3preload.so\n");
+        return 1;
+    }
+
+    /* The glibc conventions programs rely on. */
+    void *empty = malloc(0);
+    assert(empty != NULL);
+    free(empty);
+    char *zeroed = calloc(100, 10);
+    assert(zeroed != NULL && zeroed[0] == 0 && zeroed[999] == 0);
+    assert(malloc_usable_size(zeroed) >= 1000);
+    free(zeroed);
+    void *aligned;
+    assert(posix_memalign(&aligned, 4096, 100) == 0 && (uintptr_t) aligned % 4096 == 0);
+    free(aligned);
+    aligned = aligned_alloc(64, 640);
+    assert(aligned != NULL && (uintptr_t) aligned % 64 == 0);
+    free(aligned);
+    volatile size_t too_big = (size_t) -1;
+    assert(malloc(too_big) == NULL && errno == ENOMEM);
+    char *text = strdup("preloaded");
+    text = realloc(text, 100000);
+    assert(text != NULL && !strcmp(text, "preloaded"));
+    free(text);
+
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, churn, (void *) (long) i);
+    }
+    for (int i = 0; i < FORKS; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            char *block = malloc(1000);
+            free(malloc(100000));
+            _exit(block == NULL);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    done = 1;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("preload test successful!\n");
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * mm_realloc_bench.c
+ *
+ * Grows vectors one element at a time the way vector_push in
+ * hw1/tokenizer.c does, reallocating on every push, while allocating a
+ * small word for each element in between. Several vectors grow at once,
+ * so their neighbours are not always free.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mm_alloc.h"
+
+#define VECTORS 16
+#define PUSHES 8000
+
+static void *vector_push(char ***pointer, size_t *size, void *elem) {
+    *pointer = (char**) mm_realloc(*pointer, sizeof(char *) * (*size + 1));
+    (*pointer)[*size] = elem;
+    *size += 1;
+    return elem;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    int vectors = argc > 1 ? atoi(argv[1]) : VECTORS;
+    int pushes = argc > 2 ? atoi(argv[2]) : PUSHES;
+    /* Not from malloc: libc must not move the break while we measure. */
+    static char **tokens[1024];
+    static size_t lengths[1024];
+
+    printf("%d vectors of %d pushes\n", vectors, pushes);
+    double start = now();
+    for (int n = 0; n < pushes; n++) {
+        for (int v = 0; v < vectors; v++) {
+            char *word = mm_malloc(8 + n % 24);
+            strcpy(word, "token");
+            vector_push(&tokens[v], &lengths[v], word);
+        }
+    }
+    double elapsed = now() - start;
+
+    for (int v = 0; v < vectors; v++) {
+        for (size_t i = 0; i < lengths[v]; i++) {
+            if (strcmp(tokens[v][i], "token") != 0) {
+                fprintf(stderr, "Vector %d lost element %zu\n", v, i);
+                return 1;
+            }
+            mm_free(tokens[v][i]);
+        }
+        mm_free(tokens[v]);
+    }
+    printf("%.1f ns per push\n", elapsed * 1e9 / ((double) vectors * pushes));
+    return 0;
+}
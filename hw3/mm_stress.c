@@ -0,0 +1,168 @@
+/*
+ * mm_stress.c
+ *
+ * Hammers mm_alloc from several threads at once. Each thread keeps a pool
+ * of live blocks filled with a pattern of its own and randomly frees,
+ * reallocates and allocates them, checking the pattern every time (and
+ * that blocks from mm_calloc start out zeroed). At the end, with
+ * everything freed, mm_stats must add up to nothing live. Half
+ * of the blocks a thread gives up are handed to the next thread through a
+ * mailbox, so that blocks are routinely freed by a thread other than the
+ * one that allocated them.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm_alloc.h"
+
+#define THREADS 8
+#define ITERATIONS 200000
+#define POOL 256
+#define MAILBOX 1024
+#define MAX_SIZE 2048
+
+typedef struct slot {
+    unsigned char *data;
+    size_t size;
+    unsigned char tag;
+} slot_t;
+
+typedef struct mailbox {
+    pthread_mutex_t lock;
+    slot_t slots[MAILBOX];
+    int count;
+} mailbox_t;
+
+static mailbox_t mailboxes[THREADS];
+static int iterations = ITERATIONS;
+
+static void fill(slot_t *slot) {
+    memset(slot->data, slot->tag, slot->size);
+}
+
+static void check(slot_t *slot) {
+    for (size_t i = 0; i < slot->size; i++) {
+        if (slot->data[i] != slot->tag) {
+            fprintf(stderr, "Corrupted block %p at byte %zu\n", (void*) slot->data, i);
+            abort();
+        }
+    }
+}
+
+static size_t random_size(unsigned int *seed) {
+    /* Mostly small blocks, like real programs. */
+    return rand_r(seed) % 4 ? 1 + rand_r(seed) % 128 : 1 + rand_r(seed) % MAX_SIZE;
+}
+
+static void *stress(void *arg) {
+    int id = (int) (long) arg;
+    unsigned int seed = id;
+    slot_t pool[POOL] = {{0}};
+    mailbox_t *outbox = &mailboxes[(id + 1) % THREADS];
+    mailbox_t *inbox = &mailboxes[id];
+
+    for (int n = 0; n < iterations; n++) {
+        slot_t *slot = &pool[rand_r(&seed) % POOL];
+        if (slot->data) {
+            check(slot);
+            int action = rand_r(&seed) % 4;
+            if (action == 0) {
+                size_t size = random_size(&seed);
+                unsigned char *data = mm_realloc(slot->data, size);
+                assert(data != NULL && (uintptr_t) data % 16 == 0);
+                slot->data = data;
+                if (size < slot->size) {
+                    slot->size = size;
+                }
+                check(slot);
+                slot->size = size;
+                fill(slot);
+                continue;
+            }
+            pthread_mutex_lock(&outbox->lock);
+            if (action == 1 && outbox->count < MAILBOX) {
+                outbox->slots[outbox->count++] = *slot;
+                slot->data = NULL;
+            }
+            pthread_mutex_unlock(&outbox->lock);
+            if (slot->data) {
+                mm_free(slot->data);
+                slot->data = NULL;
+            }
+        } else {
+            slot->size = random_size(&seed);
+            slot->tag = rand_r(&seed);
+            if (rand_r(&seed) % 2) {
+                slot->data = mm_malloc(slot->size);
+                assert(slot->data != NULL && (uintptr_t) slot->data % 16 == 0);
+            } else {
+                slot->data = mm_calloc(1, slot->size);
+                assert(slot->data != NULL);
+                for (size_t i = 0; i < slot->size; i++) {
+                    assert(slot->data[i] == 0);
+                }
+            }
+            fill(slot);
+        }
+
+        if (n % 64 == 0) {
+            pthread_mutex_lock(&inbox->lock);
+            for (int i = 0; i < inbox->count; i++) {
+                check(&inbox->slots[i]);
+                mm_free(inbox->slots[i].data);
+            }
+            inbox->count = 0;
+            pthread_mutex_unlock(&inbox->lock);
+        }
+    }
+
+    for (int i = 0; i < POOL; i++) {
+        if (pool[i].data) {
+            check(&pool[i]);
+            mm_free(pool[i].data);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    pthread_t threads[THREADS];
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+
+    for (int i = 0; i < THREADS; i++) {
+        pthread_mutex_init(&mailboxes[i].lock, NULL);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, stress, (void*) (long) i);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        for (int j = 0; j < mailboxes[i].count; j++) {
+            check(&mailboxes[i].slots[j]);
+            mm_free(mailboxes[i].slots[j].data);
+        }
+    }
+
+    /* Everything was freed, and the counters must agree. */
+    mm_stats_t stats;
+    mm_stats(&stats);
+    size_t requests = 0;
+    for (int i = 0; i < MM_STATS_BUCKETS; i++) {
+        requests += stats.requests[i];
+    }
+    assert(requests >= (size_t) iterations * THREADS / 2);
+    assert(stats.mapped_blocks == 0 && stats.mapped_bytes == 0);
+    assert(stats.live_bytes < 4096);
+    assert(stats.free_bytes <= stats.heap_bytes && stats.heap_bytes <= stats.heap_peak);
+    printf("stress test successful!\n");
+    return 0;
+}
@@ -0,0 +1,404 @@
+/*
+ * mm_suite.c
+ *
+ * Runs the same allocation workloads through mm_alloc and through libc's
+ * malloc and compares the two. Every run gets a process of its own, so
+ * that peak RSS belongs to one allocator only, and both allocators see
+ * identical inputs: sizes and choices come from generators seeded per
+ * thread, never from the addresses returned.
+ *
+ *   mm_suite                  synthetic workloads on 1, 2, 4 and 8 threads
+ *   mm_suite TRACE...         replay allocation traces
+ *   mm_suite -g OPS           write a synthetic trace to stdout
+ *
+ * A trace is text, one operation per line, naming blocks by small
+ * integers:
+ *
+ *   m ID SIZE    ID = malloc(SIZE)
+ *   r ID SIZE    ID = realloc(ID, SIZE)
+ *   f ID         free(ID)
+ *
+ * The synthetic workloads are:
+ *
+ *   larson   every thread replaces random blocks in an array of its own
+ *            and, after each round, swaps the array with one left by
+ *            another thread, so that blocks are freed by threads other
+ *            than the one that allocated them (after Larson and Krishnan)
+ *   random   random frees and mallocs of sizes from 8 bytes to 8 KB
+ *   realloc  strings and vectors grown piece by piece with realloc
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm_alloc.h"
+
+#define TOTAL_OPS 2000000
+#define MAX_THREADS 8
+#define LARSON_SLOTS 1000
+#define LARSON_ROUND 10000
+#define RANDOM_SLOTS 4096
+#define GROW_VECTORS 8
+
+typedef struct allocator {
+    const char *name;
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void *);
+} allocator_t;
+
+static const allocator_t allocators[] = {
+    {"mm_alloc", mm_malloc, mm_realloc, mm_free},
+    {"libc", malloc, realloc, free},
+};
+
+typedef struct worker {
+    pthread_t thread;
+    const allocator_t *alloc;
+    int id;
+    long ops;
+} worker_t;
+
+typedef struct op {
+    char kind;
+    int id;
+    size_t size;
+} op_t;
+
+static pthread_barrier_t start_line;
+/* Arrays of blocks left for other threads by larson. */
+static void **larson_stash[MAX_THREADS];
+static pthread_mutex_t larson_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift: cheap enough not to show up next to malloc. */
+static unsigned int next_random(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Sizes spread evenly over powers of two, as they are in real programs. */
+static size_t random_size(unsigned int *state, int min_shift, int max_shift) {
+    int shift = min_shift + next_random(state) % (max_shift - min_shift + 1);
+    size_t base = (size_t) 1 << shift;
+    return base + next_random(state) % base;
+}
+
+static long resident_kb(void) {
+    long size, pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        fscanf(statm, "%ld %ld", &size, &pages);
+        fclose(statm);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long peak_resident_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void *larson(void *arg) {
+    worker_t *worker = arg;
+    const allocator_t *alloc = worker->alloc;
+    unsigned int state = 162 + worker->id;
+    void **slots = calloc(LARSON_SLOTS, sizeof(void *));
+
+    pthread_barrier_wait(&start_line);
+    for (long n = 0; n < worker->ops; n++) {
+        int slot = next_random(&state) % LARSON_SLOTS;
+        alloc->free(slots[slot]);
+        slots[slot] = alloc->malloc(random_size(&state, 4, 8));
+        if (n % LARSON_ROUND == LARSON_ROUND - 1) {
+            pthread_mutex_lock(&larson_lock);
+            int other = next_random(&state) % MAX_THREADS;
+            void **left = larson_stash[other];
+            larson_stash[other] = slots;
+            pthread_mutex_unlock(&larson_lock);
+            if (left) {
+                slots = left;
+            } else {
+                slots = calloc(LARSON_SLOTS, sizeof(void *));
+            }
+        }
+    }
+    for (int i = 0; i < LARSON_SLOTS; i++) {
+        alloc->free(slots[i]);
+    }
+    free(slots);
+    return NULL;
+}
+
+static void *random_sizes(void *arg) {
+    worker_t *worker = arg;
+    const allocator_t *alloc = worker->alloc;
+    unsigned int state = 1729 + worker->id;
+    void **slots = calloc(RANDOM_SLOTS, sizeof(void *));
+
+    pthread_barrier_wait(&start_line);
+    for (long n = 0; n < worker->ops; n++) {
+        int slot = next_random(&state) % RANDOM_SLOTS;
+        if (slots[slot]) {
+            alloc->free(slots[slot]);
+            slots[slot] = NULL;
+        } else {
+            size_t size = random_size(&state, 3, 12);
+            slots[slot] = alloc->malloc(size);
+            memset(slots[slot], 0, size < 64 ? size : 64);
+        }
+    }
+    for (int i = 0; i < RANDOM_SLOTS; i++) {
+        alloc->free(slots[i]);
+    }
+    free(slots);
+    return NULL;
+}
+
+static void *realloc_growth(void *arg) {
+    worker_t *worker = arg;
+    const allocator_t *alloc = worker->alloc;
+    unsigned int state = 4104 + worker->id;
+    char *vectors[GROW_VECTORS] = {NULL};
+    size_t lengths[GROW_VECTORS] = {0};
+
+    pthread_barrier_wait(&start_line);
+    for (long n = 0; n < worker->ops; n++) {
+        int v = next_random(&state) % GROW_VECTORS;
+        /* Strings grow a few bytes at a time, vectors a pointer at a
+         * time; both start over once they reach 64 KB. */
+        size_t step = v % 2 ? 1 + next_random(&state) % 16 : sizeof(void *);
+        if (lengths[v] + step > 64 * 1024) {
+            alloc->free(vectors[v]);
+            vectors[v] = NULL;
+            lengths[v] = 0;
+        }
+        vectors[v] = alloc->realloc(vectors[v], lengths[v] + step);
+        vectors[v][lengths[v]] = (char) n;
+        lengths[v] += step;
+    }
+    for (int i = 0; i < GROW_VECTORS; i++) {
+        alloc->free(vectors[i]);
+    }
+    return NULL;
+}
+
+typedef struct workload {
+    const char *name;
+    void *(*run)(void *);
+} workload_t;
+
+static const workload_t workloads[] = {
+    {"larson", larson},
+    {"random", random_sizes},
+    {"realloc", realloc_growth},
+};
+
+static void print_header(void) {
+    printf("%-10s %7s %-9s %14s %12s %14s\n", "workload", "threads", "allocator",
+           "ops/s", "peak KB", "fragmentation");
+}
+
+/* Prints a result line. Fragmentation is only known for mm_alloc. */
+static void print_result(const char *workload, int threads, const allocator_t *alloc,
+                         double ops_per_second, long peak_kb, double fragmentation) {
+    printf("%-10s %7d %-9s %14.0f %12ld ", workload, threads, alloc->name, ops_per_second,
+           peak_kb);
+    if (fragmentation >= 0) {
+        printf("%14.2f\n", fragmentation);
+    } else {
+        printf("%14s\n", "-");
+    }
+    fflush(stdout);
+}
+
+static double fragmentation(const allocator_t *alloc) {
+    if (alloc->malloc != mm_malloc) {
+        return -1;
+    }
+    mm_stats_t stats;
+    mm_stats(&stats);
+    return stats.fragmentation;
+}
+
+static void run_workload(const workload_t *workload, int threads, const allocator_t *alloc) {
+    worker_t workers[MAX_THREADS];
+    long baseline = resident_kb();
+
+    pthread_barrier_init(&start_line, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i].alloc = alloc;
+        workers[i].id = i;
+        workers[i].ops = TOTAL_OPS / threads;
+        pthread_create(&workers[i].thread, NULL, workload->run, &workers[i]);
+    }
+    pthread_barrier_wait(&start_line);
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = now() - start;
+    double frag = fragmentation(alloc);
+    print_result(workload->name, threads, alloc, TOTAL_OPS / elapsed,
+                 peak_resident_kb() - baseline, frag);
+}
+
+static op_t *read_trace(const char *path, int *count, int *max_id) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+    int capacity = 1024;
+    op_t *ops = malloc(capacity * sizeof(op_t));
+    char line[256];
+    *count = 0;
+    *max_id = 0;
+    while (fgets(line, sizeof(line), file)) {
+        op_t op = {0};
+        int fields = sscanf(line, " %c %d %zu", &op.kind, &op.id, &op.size);
+        if (fields < 2 || op.id < 0 || (op.kind != 'f' && fields < 3) ||
+            !strchr("mrf", op.kind)) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity *= 2;
+            ops = realloc(ops, capacity * sizeof(op_t));
+        }
+        ops[(*count)++] = op;
+        if (op.id > *max_id) {
+            *max_id = op.id;
+        }
+    }
+    fclose(file);
+    return ops;
+}
+
+static void replay(const char *path, const allocator_t *alloc) {
+    int count, max_id;
+    op_t *ops = read_trace(path, &count, &max_id);
+    if (!ops) {
+        return;
+    }
+    void **blocks = calloc(max_id + 1, sizeof(void *));
+    size_t *sizes = calloc(max_id + 1, sizeof(size_t));
+    size_t live = 0, peak_live = 0;
+    long baseline = resident_kb();
+
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        op_t *op = &ops[i];
+        switch (op->kind) {
+        case 'm':
+            blocks[op->id] = alloc->malloc(op->size);
+            break;
+        case 'r':
+            blocks[op->id] = alloc->realloc(blocks[op->id], op->size);
+            break;
+        case 'f':
+            alloc->free(blocks[op->id]);
+            blocks[op->id] = NULL;
+            break;
+        }
+        /* Touch the block, as its owner would. */
+        if (op->kind != 'f' && op->size) {
+            *(char *) blocks[op->id] = 0;
+        }
+        live += (op->kind == 'f' ? 0 : op->size) - sizes[op->id];
+        sizes[op->id] = op->kind == 'f' ? 0 : op->size;
+        if (live > peak_live) {
+            peak_live = live;
+        }
+    }
+    double elapsed = now() - start;
+    double frag = fragmentation(alloc);
+    print_result(path, 1, alloc, count / elapsed, peak_resident_kb() - baseline, frag);
+    printf("%-10s %7s %-9s peak live %zu KB", "", "", "", peak_live / 1024);
+    if (alloc->malloc == mm_malloc) {
+        /* How far the heap had to grow beyond what was live is the cost
+         * of fragmentation. */
+        mm_stats_t stats;
+        mm_stats(&stats);
+        printf(", heap peak %zu KB", stats.heap_peak / 1024);
+    }
+    printf("\n");
+}
+
+/* Writes a trace of blocks being allocated, grown and freed at random. */
+static void generate_trace(long ops) {
+    unsigned int state = 162;
+    int live[RANDOM_SLOTS] = {0};
+    for (long n = 0; n < ops; n++) {
+        int slot = next_random(&state) % RANDOM_SLOTS;
+        if (!live[slot]) {
+            printf("m %d %zu\n", slot, random_size(&state, 3, 12));
+            live[slot] = 1;
+        } else if (next_random(&state) % 4 == 0) {
+            printf("r %d %zu\n", slot, random_size(&state, 3, 14));
+        } else {
+            printf("f %d\n", slot);
+            live[slot] = 0;
+        }
+    }
+}
+
+/* Runs one measurement in a child process of its own. */
+static void in_child(void (*measure)(const void *, const void *, int), const void *what,
+                     const void *alloc, int threads) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        measure(what, alloc, threads);
+        exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+static void measure_workload(const void *what, const void *alloc, int threads) {
+    run_workload(what, threads, alloc);
+}
+
+static void measure_trace(const void *what, const void *alloc, int threads) {
+    replay(what, alloc);
+}
+
+int main(int argc, char **argv) {
+    if (argc == 3 && !strcmp(argv[1], "-g")) {
+        generate_trace(atol(argv[2]));
+        return 0;
+    }
+
+    print_header();
+    int allocator_count = sizeof(allocators) / sizeof(allocators[0]);
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            for (int a = 0; a < allocator_count; a++) {
+                in_child(measure_trace, argv[i], &allocators[a], 1);
+            }
+        }
+        return 0;
+    }
+    for (int w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+            for (int a = 0; a < allocator_count; a++) {
+                in_child(measure_workload, &workloads[w], &allocators[a], threads);
+            }
+        }
+    }
+    return 0;
+}
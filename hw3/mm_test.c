@@ -1,12 +1,27 @@
 #include <assert.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
 
 /* Function pointers to hw3 functions */
 void* (*mm_malloc)(size_t);
+void* (*mm_calloc)(size_t, size_t);
 void* (*mm_realloc)(void*, size_t);
 void (*mm_free)(void*);
+void* (*mm_memalign)(size_t, size_t);
+int (*mm_posix_memalign)(void**, size_t, size_t);
+void (*mm_release_empty_slabs)(void);
+void* (*mm_arena_create)(void);
+void* (*mm_arena_alloc)(void*, size_t);
+void (*mm_arena_reset)(void*);
+void (*mm_arena_destroy)(void*);
+void (*mm_profile_start)(size_t);
+int (*mm_profile_dump)(const char*);
 
 void load_alloc_functions() {
     void *handle = dlopen("hw3lib.so", RTLD_NOW);
@@ -22,6 +37,12 @@ void load_alloc_functions() {
         exit(1);
     }
 
+    mm_calloc = dlsym(handle, "mm_calloc");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
     mm_realloc = dlsym(handle, "mm_realloc");
     if ((error = dlerror()) != NULL)  {
         fprintf(stderr, "%s\n", dlerror());
@@ -33,6 +54,85 @@ void load_alloc_functions() {
         fprintf(stderr, "%s\n", dlerror());
         exit(1);
     }
+
+    mm_memalign = dlsym(handle, "mm_memalign");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_posix_memalign = dlsym(handle, "mm_posix_memalign");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_release_empty_slabs = dlsym(handle, "mm_release_empty_slabs");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_arena_create = dlsym(handle, "mm_arena_create");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_arena_alloc = dlsym(handle, "mm_arena_alloc");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_arena_reset = dlsym(handle, "mm_arena_reset");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_arena_destroy = dlsym(handle, "mm_arena_destroy");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_profile_start = dlsym(handle, "mm_profile_start");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_profile_dump = dlsym(handle, "mm_profile_dump");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+}
+
+static long minor_faults(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+/* Reads the totals line of a heap profile: objects and bytes live, then
+ * ever allocated, and the sampling rate. */
+static void read_profile(const char *path, size_t totals[5]) {
+    FILE *profile = fopen(path, "r");
+    assert(profile != NULL);
+    assert(fscanf(profile, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &totals[0],
+                  &totals[1], &totals[2], &totals[3], &totals[4]) == 5);
+    fclose(profile);
+}
+
+static int all_zero(const char *p, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (p[i]) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 int main() {
@@ -42,6 +142,181 @@ int main() {
     assert(data != NULL);
     data[0] = 0x162;
     mm_free(data);
+
+    /* Large requests take the best fit, and the lowest of equal fits,
+     * whatever order the blocks were freed in. */
+    char *wide = mm_malloc(100000), *gap1 = mm_malloc(1000);
+    char *fit1 = mm_malloc(30000), *gap2 = mm_malloc(1000);
+    char *fit2 = mm_malloc(30000), *gap3 = mm_malloc(1000);
+    char *lower = fit1 < fit2 ? fit1 : fit2, *higher = fit1 < fit2 ? fit2 : fit1;
+    mm_free(higher);
+    mm_free(lower);
+    mm_free(wide);
+    assert(mm_malloc(30000) == lower);
+    assert(mm_malloc(30000) == higher);
+    assert(mm_malloc(100000) == wide);
+    mm_free(fit1);
+    mm_free(fit2);
+    mm_free(wide);
+    mm_free(gap1);
+    mm_free(gap2);
+    mm_free(gap3);
+
+    /* Large blocks are mapped, and keep their contents across realloc. */
+    char *big = mm_malloc(1 << 20);
+    assert(big != NULL);
+    memset(big, 'x', 1 << 20);
+    big = mm_realloc(big, 4 << 20);
+    assert(big != NULL && big[0] == 'x' && big[(1 << 20) - 1] == 'x');
+    big = mm_realloc(big, 100);
+    assert(big != NULL && big[99] == 'x');
+    mm_free(big);
+
+    /* Freeing a burst of heap blocks gives the memory back. The first heap
+     * block sets up the heap itself, which stays. */
+    void *anchor = mm_malloc(1000);
+    void *top = sbrk(0);
+    void *burst[64];
+    for (int i = 0; i < 64; i++) {
+        burst[i] = mm_malloc(64 * 1024);
+        assert(burst[i] != NULL);
+    }
+    assert(sbrk(0) > top);
+    for (int i = 0; i < 64; i++) {
+        mm_free(burst[i]);
+    }
+    assert(sbrk(0) == top);
+    mm_free(anchor);
+
+    /* mm_calloc clears reused memory, at every size. */
+    size_t sizes[] = {24, 4000, 100000, 1 << 20};
+    for (int i = 0; i < 4; i++) {
+        char *dirty = mm_malloc(sizes[i]);
+        assert(dirty != NULL);
+        memset(dirty, 'x', sizes[i]);
+        mm_free(dirty);
+        char *clean = mm_calloc(1, sizes[i]);
+        assert(clean != NULL && all_zero(clean, sizes[i]));
+        mm_free(clean);
+    }
+    assert(mm_calloc(SIZE_MAX / 2, 4) == NULL);
+
+    /* Large blocks are not touched until they are used. */
+    long faults = minor_faults();
+    char *untouched = mm_malloc(64 << 20);
+    assert(untouched != NULL);
+    assert(minor_faults() - faults < 64);
+    mm_free(untouched);
+
+    /* Every payload is 16-byte aligned, whatever was split before it. */
+    void *blocks[256];
+    for (int i = 0; i < 256; i++) {
+        blocks[i] = mm_malloc(1 + i * 37 % 3000);
+        assert(blocks[i] != NULL && (uintptr_t) blocks[i] % 16 == 0);
+        memset(blocks[i], 'x', 1 + i * 37 % 3000);
+    }
+    for (int i = 0; i < 256; i += 2) {
+        blocks[i] = mm_realloc(blocks[i], 1 + i * 53 % 5000);
+        assert(blocks[i] != NULL && (uintptr_t) blocks[i] % 16 == 0);
+    }
+    for (int i = 0; i < 256; i++) {
+        mm_free(blocks[i]);
+    }
+    assert(mm_malloc(SIZE_MAX) == NULL);
+
+    /* Larger alignments, from the heap and from mappings. */
+    size_t alignments[] = {32, 64, 4096, 1 << 16};
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            char *p = mm_memalign(alignments[i], sizes[j]);
+            assert(p != NULL && (uintptr_t) p % alignments[i] == 0);
+            memset(p, 'x', sizes[j]);
+            blocks[j] = p;
+        }
+        for (int j = 0; j < 4; j++) {
+            mm_free(blocks[j]);
+        }
+    }
+    void *aligned;
+    assert(mm_posix_memalign(&aligned, 24, 100) == EINVAL);
+    assert(mm_posix_memalign(&aligned, 256, 100) == 0);
+    assert((uintptr_t) aligned % 256 == 0);
+    mm_free(aligned);
+
+    /* Small objects come from slabs and carry no header, so most of them
+     * sit right next to the one allocated before. */
+    static char *small[4096];
+    int adjacent = 0;
+    for (int i = 0; i < 4096; i++) {
+        small[i] = mm_malloc(16);
+        assert(small[i] != NULL && (uintptr_t) small[i] % 16 == 0);
+        memset(small[i], i, 16);
+        if (i && (small[i] - small[i - 1] == 16 || small[i - 1] - small[i] == 16)) {
+            adjacent++;
+        }
+    }
+    assert(adjacent > 4096 * 3 / 4);
+    for (int i = 0; i < 4096; i++) {
+        assert(small[i][0] == (char) i && small[i][15] == (char) i);
+        small[i] = mm_realloc(small[i], i % 2 ? 12 : 100);
+        assert(small[i] != NULL && small[i][11] == (char) i);
+    }
+    for (int i = 0; i < 4096; i++) {
+        mm_free(small[i]);
+    }
+    mm_release_empty_slabs();
+    char *reused = mm_calloc(1, 200);
+    assert(reused != NULL && all_zero(reused, 200));
+    mm_free(reused);
+
+    /* Arenas hand out aligned, separate objects, and after a reset the
+     * same memory again. */
+    void *arena = mm_arena_create();
+    assert(arena != NULL && mm_arena_alloc(arena, 0) == NULL);
+    char *first = NULL;
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 4096; i++) {
+            size_t size = i % 100 == 99 ? 20000 : 1 + i % 300;
+            small[i] = mm_arena_alloc(arena, size);
+            assert(small[i] != NULL && (uintptr_t) small[i] % 16 == 0);
+            memset(small[i], i, size);
+        }
+        for (int i = 0; i < 4096; i++) {
+            size_t size = i % 100 == 99 ? 20000 : 1 + i % 300;
+            assert(small[i][0] == (char) i && small[i][size - 1] == (char) i);
+        }
+        assert(first == NULL || small[0] == first);
+        first = small[0];
+        mm_arena_reset(arena);
+    }
+    mm_arena_destroy(arena);
+
+    /* Sampled blocks work like any other, and the profile counts them
+     * while they live. */
+    char path[] = "/tmp/mm_test_profile_XXXXXX";
+    close(mkstemp(path));
+    size_t totals[5];
+    mm_profile_start(4096);
+    for (int i = 0; i < 1000; i++) {
+        small[i] = mm_malloc(1000);
+        memset(small[i], i, 1000);
+    }
+    for (int i = 0; i < 1000; i++) {
+        small[i] = mm_realloc(small[i], 1000 + i);
+        assert(small[i] != NULL && small[i][0] == (char) i && small[i][999] == (char) i);
+    }
+    assert(mm_profile_dump(path) == 0);
+    read_profile(path, totals);
+    assert(totals[0] > 0 && totals[1] > 0 && totals[4] == 4096);
+    for (int i = 0; i < 1000; i++) {
+        mm_free(small[i]);
+    }
+    assert(mm_profile_dump(path) == 0);
+    read_profile(path, totals);
+    assert(totals[0] == 0 && totals[1] == 0 && totals[2] > 0);
+    mm_profile_start(0);
+    unlink(path);
+
     printf("malloc test successful!\n");
     return 0;
 }